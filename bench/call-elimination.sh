@@ -0,0 +1,47 @@
+#!/usr/bin/env bash
+#
+# call-elimination.sh - Report how many calls the optimizer removes from a
+# corpus of scripts, now that user definitions carry the attributes their
+# effects allow.  Runs each script on its own and prints the -print-stats
+# call counts for it, then the totals.
+#
+# Usage: bench/call-elimination.sh DEMO [SCRIPT...]
+#
+# Without scripts, the corpus next to this one is used.
+
+set -eu
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 DEMO [SCRIPT...]" >&2
+    exit 1
+fi
+Demo=$1
+shift
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/corpus/*.ks
+fi
+
+Tmp=$(mktemp -d)
+trap 'rm -rf "$Tmp"' EXIT
+
+printf '%-24s %8s %8s %8s %8s\n' script defined readnone before after
+TotalDefined=0 TotalPure=0 TotalBefore=0 TotalAfter=0
+for Script in "$@"; do
+    "$Demo" -print-stats <"$Script" 2>"$Tmp/log" >/dev/null
+    # "N functions defined, M inferred readnone"
+    read -r Defined Pure < <(sed -n 's/^\([0-9]*\) functions defined, \([0-9]*\) inferred readnone$/\1 \2/p' "$Tmp/log")
+    # "N calls before optimization, M after (K removed)"
+    read -r Before After < <(sed -n 's/^\([0-9]*\) calls before optimization, \([0-9]*\) after .*/\1 \2/p' "$Tmp/log")
+    if [ -z "${After:-}" ]; then
+        echo "$Demo printed no call counts for $Script" >&2
+        exit 1
+    fi
+    printf '%-24s %8d %8d %8d %8d\n' "$(basename "$Script")" "$Defined" "$Pure" "$Before" "$After"
+    TotalDefined=$((TotalDefined + Defined))
+    TotalPure=$((TotalPure + Pure))
+    TotalBefore=$((TotalBefore + Before))
+    TotalAfter=$((TotalAfter + After))
+    unset Before After
+done
+printf '%-24s %8d %8d %8d %8d\n' total "$TotalDefined" "$TotalPure" "$TotalBefore" "$TotalAfter"
+echo "$((TotalBefore - TotalAfter)) of $TotalBefore calls removed"
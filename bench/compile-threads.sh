@@ -0,0 +1,62 @@
+#!/usr/bin/env bash
+#
+# compile-threads.sh - Measure how fast a large library of definitions loads
+# with 0 (compile each as it is read), 1, 2, 4, ... up to every core's worth
+# of -compile-threads.
+#
+# Usage: bench/compile-threads.sh DEMO [DEFINITIONS] [RUNS]
+
+set -eu
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 DEMO [DEFINITIONS] [RUNS]" >&2
+    exit 1
+fi
+Demo=$1
+NumDefs=${2:-20000}
+NumRuns=${3:-3}
+Cores=$(nproc 2>/dev/null || sysctl -n hw.ncpu)
+
+Tmp=$(mktemp -d)
+trap 'rm -rf "$Tmp"' EXIT
+
+# Definitions big enough that compiling them, not parsing them, dominates.
+# Each calls the one before, so running the last one, as the final top-level
+# expression does, runs them all: whatever the mode, every one of them has
+# been compiled and linked before the clock stops.
+awk -v N="$NumDefs" 'BEGIN {
+    print "def f0(x y) x + y;"
+    for (i = 1; i < N; i++)
+        printf "def f%d(x y) var s = 0 in (for j = 0, j < x in s = s + f%d(j, y) * %d) + " \
+            "if y < %d then s else 0 - s;\n", i, i - 1, i % 13 + 1, i % 31
+    printf "f%d(2, 3);\n", N - 1
+}' >"$Tmp/library.ks"
+
+Threads=(0)
+for ((T = 1; T < Cores; T *= 2)); do
+    Threads+=("$T")
+done
+Threads+=("$Cores")
+
+echo "$NumDefs definitions, best of $NumRuns runs, $Cores cores"
+printf '%8s %12s %14s\n' threads ms defs/second
+for T in "${Threads[@]}"; do
+    Best=
+    for ((Run = 0; Run < NumRuns; Run++)); do
+        "$Demo" -print-stats -compile-threads="$T" <"$Tmp/library.ks" 2>"$Tmp/log" >/dev/null
+        if ! grep -q 'Evaluated to ' "$Tmp/log"; then
+            echo "$Demo -compile-threads=$T didn't run the final expression" >&2
+            exit 1
+        fi
+        # "N definitions loaded in X ms (Y per second), ..."
+        Ms=$(sed -n 's/.* definitions loaded in \([0-9.]*\) ms.*/\1/p' "$Tmp/log")
+        if [ -z "$Ms" ]; then
+            echo "$Demo -compile-threads=$T printed no load time" >&2
+            exit 1
+        fi
+        if [ -z "$Best" ] || awk -v A="$Ms" -v B="$Best" 'BEGIN { exit !(A < B) }'; then
+            Best=$Ms
+        fi
+    done
+    printf '%8s %12s %14.0f\n' "$T" "$Best" "$(awk -v N="$NumDefs" -v Ms="$Best" 'BEGIN { print N * 1000 / Ms }')"
+done
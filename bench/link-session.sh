@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+#
+# link-session.sh - Measure linking over a long session of top-level
+# expressions: time per expression, link time, how many pages JIT'd code is
+# spread over and the peak resident set.  Give it a second demo binary, e.g.
+# one built from before the JIT linked with JITLink, to compare the two.
+#
+# Usage: bench/link-session.sh DEMO [BASELINE-DEMO] [EXPRESSIONS]
+#
+# The mappings are read from /proc while the session is still live, so this
+# needs Linux.
+
+set -eu
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 DEMO [BASELINE-DEMO] [EXPRESSIONS]" >&2
+    exit 1
+fi
+Demos=("$1")
+if [ $# -ge 2 ] && [ -n "$2" ]; then
+    Demos+=("$2")
+fi
+NumExprs=${3:-100000}
+PageSize=$(getconf PAGESIZE)
+
+Tmp=$(mktemp -d)
+trap 'rm -rf "$Tmp"' EXIT
+
+# Every top-level expression is its own module, linked, run and then freed.
+# The last one prints a marker no other expression's value can look like, so
+# we know when the session is done.
+{
+    echo 'extern printd(x);'
+    echo 'def scale(x) x * 3 + 1;'
+    awk -v N="$NumExprs" 'BEGIN { for (i = 0; i < N; i++) printf "scale(%d) + %d;\n", i, i % 97 }'
+    echo 'printd(0.4242);'
+} >"$Tmp/session.ks"
+
+run()
+{
+    local Demo=$1
+    rm -f "$Tmp/in" && mkfifo "$Tmp/in"
+    "$Demo" -print-stats <"$Tmp/in" 2>"$Tmp/log" &
+    local Pid=$!
+    exec 3>"$Tmp/in"
+
+    local Start End
+    Start=$(date +%s%N)
+    cat "$Tmp/session.ks" >&3
+    until grep -Eq '(^|[^0-9])0\.424200$' "$Tmp/log"; do
+        if ! kill -0 "$Pid" 2>/dev/null; then
+            echo "$Demo exited before the session finished:" >&2
+            tail -n 5 "$Tmp/log" >&2
+            exit 1
+        fi
+        sleep 0.05
+    done
+    End=$(date +%s%N)
+
+    # JIT'd code lives in anonymous executable mappings.
+    local CodePages=0 Mappings=0 Range Perms Offset Dev Inode Path
+    while read -r Range Perms Offset Dev Inode Path; do
+        if [ -z "$Path" ]; then
+            Mappings=$((Mappings + 1))
+            if [[ $Perms == *x* ]]; then
+                CodePages=$((CodePages + (0x${Range#*-} - 0x${Range%-*}) / PageSize))
+            fi
+        fi
+    done </proc/"$Pid"/maps
+    local PeakRSS
+    PeakRSS=$(awk '/^VmHWM:/ { print $2 }' /proc/"$Pid"/status)
+
+    exec 3>&-
+    wait "$Pid"
+
+    echo "== $Demo"
+    echo "$NumExprs expressions in $(((End - Start) / 1000000)) ms," \
+        "$(((End - Start) / 1000 / NumExprs)) us each"
+    echo "$CodePages pages of JIT'd code, $Mappings anonymous mappings"
+    echo "peak resident set $PeakRSS KB"
+    grep -E 'objects linked|top-level expressions evaluated' "$Tmp/log" || true
+}
+
+for Demo in "${Demos[@]}"; do
+    run "$Demo"
+done
@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+#
+# operator-inlining.sh - Time a Mandelbrot-style script whose inner loop is
+# made of user-defined operators, which are only cheap if their bodies are
+# inlined into it.  Give it a second demo binary, e.g. one built from before
+# operators were inlined across modules, to compare the two.
+#
+# Usage: bench/operator-inlining.sh DEMO [BASELINE-DEMO] [RUNS]
+
+set -eu
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 DEMO [BASELINE-DEMO] [RUNS]" >&2
+    exit 1
+fi
+Demos=("$1")
+if [ $# -ge 2 ] && [ -n "$2" ]; then
+    Demos+=("$2")
+fi
+NumRuns=${3:-3}
+
+Tmp=$(mktemp -d)
+trap 'rm -rf "$Tmp"' EXIT
+
+cat >"$Tmp/mandel.ks" <<'KS'
+extern printd(x);
+
+def unary!(v) if v then 0 else 1;
+def binary| 5 (LHS RHS) if LHS then 1 else if RHS then 1 else 0;
+def binary& 6 (LHS RHS) if !LHS then 0 else !!RHS;
+def binary : 1 (x y) y;
+
+def mandelconverger(real imag iters creal cimag)
+  if iters > 255 | (real*real + imag*imag > 4) then
+    iters
+  else
+    mandelconverger(real*real - imag*imag + creal, 2*real*imag + cimag, iters+1, creal, cimag);
+
+def mandelconverge(real imag)
+  mandelconverger(real, imag, 0, real, imag);
+
+# The sum of the escape iterations over the grid, instead of a picture, so
+# that the time goes into the operators rather than into printing.
+def mandelsum(xmin xmax xstep ymin ymax ystep)
+  var sum = 0 in
+    (for y = ymin, y < ymax & !(sum < 0), ystep in
+       for x = xmin, x < xmax, xstep in
+         sum = sum + mandelconverge(x, y)) : sum;
+
+printd(mandelsum(-2.3, 0.9, 0.005, -1.3, 1.3, 0.005));
+KS
+
+for Demo in "${Demos[@]}"; do
+    Best=
+    for ((Run = 0; Run < NumRuns; Run++)); do
+        Start=$(date +%s%N)
+        "$Demo" -print-stats <"$Tmp/mandel.ks" 2>"$Tmp/log" >/dev/null
+        End=$(date +%s%N)
+        Ms=$(((End - Start) / 1000000))
+        if [ -z "$Best" ] || [ "$Ms" -lt "$Best" ]; then
+            Best=$Ms
+        fi
+    done
+    echo "== $Demo"
+    echo "best of $NumRuns runs: $Best ms"
+    # The sum, to check that both builds computed the same thing.
+    grep -E '^(ready> )*[0-9]+\.[0-9]+$' "$Tmp/log" | sed 's/^\(ready> \)*/sum /' || true
+    grep -E 'calls inlined|calls before optimization' "$Tmp/log" || true
+done
@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+#
+# repl-latency.sh - Measure how long the REPL takes per one-line top-level
+# expression, over a session of many of them.  Give it several demo binaries,
+# e.g. one built from before the pass and analysis managers were kept for the
+# whole session, to compare them.
+#
+# Usage: bench/repl-latency.sh DEMO... [-n EXPRESSIONS]
+
+set -eu
+
+NumExprs=10000
+Demos=()
+while [ $# -gt 0 ]; do
+    case $1 in
+    -n)
+        NumExprs=$2
+        shift 2
+        ;;
+    *)
+        Demos+=("$1")
+        shift
+        ;;
+    esac
+done
+if [ ${#Demos[@]} -eq 0 ]; then
+    echo "usage: $0 DEMO... [-n EXPRESSIONS]" >&2
+    exit 1
+fi
+
+Tmp=$(mktemp -d)
+trap 'rm -rf "$Tmp"' EXIT
+
+awk -v N="$NumExprs" 'BEGIN { for (i = 1; i <= N; i++) printf "%d + 1;\n", i }' >"$Tmp/session.ks"
+
+for Demo in "${Demos[@]}"; do
+    Start=$(date +%s%N)
+    "$Demo" -print-stats <"$Tmp/session.ks" 2>"$Tmp/log" >/dev/null
+    End=$(date +%s%N)
+    Evaluated=$(grep -c '^\(ready> \)*Evaluated to ' "$Tmp/log" || true)
+    echo "== $Demo"
+    echo "$Evaluated of $NumExprs expressions evaluated in $(((End - Start) / 1000000)) ms," \
+        "$(((End - Start) / 1000 / NumExprs)) us each"
+    grep 'top-level expressions evaluated' "$Tmp/log" || true
+done
@@ -1,75 +1,733 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
-#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/MapperJITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/MemoryMapper.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
+#include <vector>
 
 namespace llvm
 {
 namespace orc
 {
 
+/// handleLazyCallThroughError - Called instead of a lazily compiled function
+/// whose body can't be found.
+static void handleLazyCallThroughError()
+{
+    fprintf(stderr, "Error: could not find the body of a lazily compiled function\n");
+    exit(1);
+}
+
+/// ThreadPoolTaskDispatcher - Runs the session's materialization tasks on a
+/// fixed number of threads, so that code is compiled in the background.
+class ThreadPoolTaskDispatcher : public TaskDispatcher
+{
+    std::mutex Lock;
+    std::condition_variable Ready;
+    std::deque<std::unique_ptr<Task>> Tasks;
+    std::vector<std::thread> Threads;
+    bool ShuttingDown = false;
+
+  public:
+    explicit ThreadPoolTaskDispatcher(unsigned NumThreads)
+    {
+        for (unsigned i = 0; i != NumThreads; ++i)
+            Threads.emplace_back([this] { work(); });
+    }
+
+    void dispatch(std::unique_ptr<Task> T) override
+    {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            Tasks.push_back(std::move(T));
+        }
+        Ready.notify_one();
+    }
+
+    /// shutdown - Finish the tasks already dispatched, then stop the threads.
+    void shutdown() override
+    {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            ShuttingDown = true;
+        }
+        Ready.notify_all();
+        for (std::thread &T : Threads)
+            T.join();
+        Threads.clear();
+    }
+
+  private:
+    void work()
+    {
+        while (true)
+        {
+            std::unique_ptr<Task> T;
+            {
+                std::unique_lock<std::mutex> Guard(Lock);
+                Ready.wait(Guard, [this] { return ShuttingDown || !Tasks.empty(); });
+                if (Tasks.empty())
+                    return;
+                T = std::move(Tasks.front());
+                Tasks.pop_front();
+            }
+            T->run();
+        }
+    }
+};
+
+/// JITObjectCache - Keeps the object compiled from each module in a
+/// directory, so that a later process handed the same optimized module loads
+/// it instead of running codegen.  Objects are named after a hash of the
+/// module and of the target machine options they were compiled with.  Each is
+/// written to a temporary file and renamed into place, so a reader never sees
+/// half an object, and the least recently used are deleted whenever the cache
+/// is opened or grows past its size cap.  Modules marked with exclude(), and
+/// modules with this process's addresses built into them, aren't cached:
+/// no other process could use them.
+class JITObjectCache : public ObjectCache
+{
+    std::string Dir;
+    std::string Target; // Triple, CPU, features and codegen options.
+    uint64_t MaxSizeBytes;
+
+    // The path each module being compiled is cached at.  Codegen changes the
+    // module, so it is hashed once, before that.  Also the size of the cache
+    // as of the last prune, plus what has been written since.
+    std::mutex Lock;
+    std::map<const Module *, std::string> Pending;
+    uint64_t CachedBytes = 0;
+
+    std::atomic<unsigned> Hits{0};
+    std::atomic<unsigned> Misses{0};
+
+  public:
+    JITObjectCache(std::string Dir, const JITTargetMachineBuilder &JTMB, uint64_t MaxSizeBytes)
+        : Dir(std::move(Dir)), MaxSizeBytes(MaxSizeBytes)
+    {
+        Target = JTMB.getTargetTriple().str() + "|" + JTMB.getCPU() + "|" + JTMB.getFeatures().getString() + "|" +
+                 std::to_string(int(JTMB.getCodeGenOptLevel())) + "|" +
+                 std::to_string(JTMB.getOptions().EnableFastISel);
+    }
+
+    static Expected<std::unique_ptr<JITObjectCache>> Create(StringRef Dir, const JITTargetMachineBuilder &JTMB,
+                                                            uint64_t MaxSizeBytes)
+    {
+        if (auto EC = sys::fs::create_directories(Dir))
+            return createFileError(Dir, EC);
+        auto Cache = std::make_unique<JITObjectCache>(Dir.str(), JTMB, MaxSizeBytes);
+        Cache->prune(MaxSizeBytes);
+        return std::move(Cache);
+    }
+
+    /// exclude - Keep the object compiled from M out of the cache, e.g.
+    /// because M is run once and thrown away.
+    static void exclude(Module &M)
+    {
+        M.getOrInsertNamedMetadata("kaleidoscope.uncached");
+    }
+
+    unsigned getNumHits() const
+    {
+        return Hits;
+    }
+
+    unsigned getNumMisses() const
+    {
+        return Misses;
+    }
+
+    /// getObject - The object cached for M, if there is a valid one.  A hit
+    /// counts as a use for eviction.
+    std::unique_ptr<MemoryBuffer> getObject(const Module *M) override
+    {
+        if (M->getNamedMetadata("kaleidoscope.uncached") || embedsAddresses(*M))
+            return nullptr;
+        std::string Path = getPath(*M);
+        if (auto Obj = load(Path))
+        {
+            ++Hits;
+            return Obj;
+        }
+        ++Misses;
+        std::lock_guard<std::mutex> Guard(Lock);
+        Pending[M] = std::move(Path);
+        return nullptr;
+    }
+
+    /// notifyObjectCompiled - Cache Obj, just compiled from M, and prune the
+    /// cache if that takes it over its cap.  A cache that can't be written to
+    /// only costs the next process its warm start.
+    void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override
+    {
+        std::string Path;
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            auto It = Pending.find(M);
+            if (It == Pending.end())
+                return;
+            Path = std::move(It->second);
+            Pending.erase(It);
+        }
+
+        auto Temp = sys::fs::TempFile::create(Dir + "/tmp-%%%%%%%%%%%%.o");
+        if (!Temp)
+        {
+            consumeError(Temp.takeError());
+            return;
+        }
+        raw_fd_ostream OS(Temp->FD, /*shouldClose=*/false);
+        OS << Obj.getBuffer();
+        OS.flush();
+        if (OS.has_error())
+        {
+            OS.clear_error();
+            consumeError(Temp->discard());
+            return;
+        }
+        if (auto Err = Temp->keep(Path))
+        {
+            consumeError(std::move(Err));
+            return;
+        }
+
+        // Prune to a little under the cap, so that the next few objects fit
+        // without another scan of the directory.
+        std::lock_guard<std::mutex> Guard(Lock);
+        CachedBytes += Obj.getBufferSize();
+        if (MaxSizeBytes && CachedBytes > MaxSizeBytes)
+            prune(MaxSizeBytes - MaxSizeBytes / 8);
+    }
+
+  private:
+    /// embedsAddresses - Whether M refers to memory of this process by its
+    /// address, as the code of memo functions and const arrays does.
+    static bool embedsAddresses(const Module &M)
+    {
+        SmallVector<const Constant *, 16> Worklist;
+        for (const GlobalVariable &GV : M.globals())
+            if (GV.hasInitializer())
+                Worklist.push_back(GV.getInitializer());
+        for (const Function &F : M)
+            for (const BasicBlock &BB : F)
+                for (const Instruction &I : BB)
+                {
+                    if (isa<IntToPtrInst>(I) && isa<Constant>(I.getOperand(0)))
+                        return true;
+                    for (const Value *Op : I.operands())
+                        if (auto *C = dyn_cast<Constant>(Op))
+                            Worklist.push_back(C);
+                }
+
+        SmallPtrSet<const Constant *, 16> Seen;
+        while (!Worklist.empty())
+        {
+            const Constant *C = Worklist.pop_back_val();
+            if (isa<GlobalValue>(C) || !Seen.insert(C).second)
+                continue;
+            if (auto *CE = dyn_cast<ConstantExpr>(C); CE && CE->getOpcode() == Instruction::IntToPtr)
+                return true;
+            for (const Use &Op : C->operands())
+                Worklist.push_back(cast<Constant>(Op));
+        }
+        return false;
+    }
+
+    /// getPath - Where the object compiled from M is cached.
+    std::string getPath(const Module &M)
+    {
+        SmallVector<char, 0> Bitcode;
+        raw_svector_ostream OS(Bitcode);
+        WriteBitcodeToFile(M, OS);
+        SHA1 Hash;
+        Hash.update(Target);
+        Hash.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(Bitcode.data()), Bitcode.size()));
+        return Dir + "/llvmcache-" + toHex(Hash.final());
+    }
+
+    /// load - Read the object at Path and mark it used, unless it is missing
+    /// or isn't an object file.  One that isn't is deleted, to be rewritten.
+    static std::unique_ptr<MemoryBuffer> load(const std::string &Path)
+    {
+        int FD;
+        if (sys::fs::openFileForRead(Path, FD))
+            return nullptr;
+        auto Buf = MemoryBuffer::getOpenFile(sys::fs::convertFDToNativeFileHandle(FD), Path, -1, false);
+        if (Buf)
+            sys::fs::setLastAccessAndModificationTime(FD, std::chrono::system_clock::now());
+        sys::Process::SafelyCloseFileDescriptor(FD);
+        if (!Buf)
+            return nullptr;
+        if (auto Obj = object::ObjectFile::createObjectFile((*Buf)->getMemBufferRef()); !Obj)
+        {
+            consumeError(Obj.takeError());
+            sys::fs::remove(Path);
+            return nullptr;
+        }
+        return std::move(*Buf);
+    }
+
+    /// prune - Delete the least recently used objects until the cache fits
+    /// in TargetBytes, and measure what is left.
+    void prune(uint64_t TargetBytes)
+    {
+        CachePruningPolicy Policy;
+        Policy.Interval = std::chrono::seconds(0);
+        Policy.MaxSizeBytes = TargetBytes;
+        pruneCache(Dir, Policy);
+
+        CachedBytes = 0;
+        std::error_code EC;
+        for (sys::fs::directory_iterator File(Dir, EC), End; File != End && !EC; File.increment(EC))
+            if (sys::path::filename(File->path()).starts_with("llvmcache-"))
+                if (auto Status = File->status())
+                    CachedBytes += Status->getSize();
+    }
+};
+
+/// LinkStatsPlugin - Measures how long JITLink takes to link each object, and
+/// which pages the linked code and data end up on.
+class LinkStatsPlugin : public ObjectLinkingLayer::Plugin
+{
+    std::mutex Lock;
+    std::set<uint64_t> Pages;
+    uint64_t PageSize = sys::Process::getPageSizeEstimate();
+    std::atomic<unsigned> NumLinked{0};
+    std::atomic<uint64_t> BytesLinked{0};
+    std::atomic<uint64_t> LinkNanos{0};
+
+  public:
+    /// getNumLinked - How many objects have been linked.
+    unsigned getNumLinked() const
+    {
+        return NumLinked;
+    }
+
+    /// getBytesLinked - The total size of the code and data linked.
+    uint64_t getBytesLinked() const
+    {
+        return BytesLinked;
+    }
+
+    /// getLinkTime - The time spent linking, from pruning the graph to
+    /// finishing its fixups.
+    std::chrono::nanoseconds getLinkTime() const
+    {
+        return std::chrono::nanoseconds(LinkNanos.load());
+    }
+
+    /// getNumPages - How many distinct pages linked code and data have been
+    /// placed on.  Memory freed by removed objects is reused, so in a dense
+    /// session this stays close to the size of what is live.
+    size_t getNumPages()
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        return Pages.size();
+    }
+
+    void modifyPassConfig(MaterializationResponsibility &MR, jitlink::LinkGraph &G,
+                          jitlink::PassConfiguration &Config) override
+    {
+        auto Start = std::make_shared<std::chrono::steady_clock::time_point>();
+        Config.PrePrunePasses.insert(Config.PrePrunePasses.begin(), [Start](jitlink::LinkGraph &) {
+            *Start = std::chrono::steady_clock::now();
+            return Error::success();
+        });
+        Config.PostFixupPasses.push_back([this, Start](jitlink::LinkGraph &G) {
+            LinkNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - *Start)
+                             .count();
+            ++NumLinked;
+            std::lock_guard<std::mutex> Guard(Lock);
+            for (jitlink::Block *B : G.blocks())
+            {
+                if (!B->getSize())
+                    continue;
+                BytesLinked += B->getSize();
+                uint64_t Addr = B->getAddress().getValue();
+                for (uint64_t Page = Addr / PageSize; Page <= (Addr + B->getSize() - 1) / PageSize; ++Page)
+                    Pages.insert(Page);
+            }
+            return Error::success();
+        });
+    }
+
+    Error notifyFailed(MaterializationResponsibility &MR) override
+    {
+        return Error::success();
+    }
+
+    Error notifyRemovingResources(JITDylib &JD, ResourceKey K) override
+    {
+        return Error::success();
+    }
+
+    void notifyTransferringResources(JITDylib &JD, ResourceKey DstKey, ResourceKey SrcKey) override
+    {
+    }
+};
+
+/// SymbolAddressCache - The symbols lookups have resolved, by unmangled name,
+/// so that looking a name up again skips the session's locks and the
+/// mangler.  The JIT tells it which names the modules under each resource
+/// tracker define, and removing the tracker drops those.  Stubs, and symbols
+/// from the process, live for the whole session.
+class SymbolAddressCache : public ResourceManager
+{
+    std::mutex Lock;
+    StringMap<ExecutorSymbolDef> Symbols;
+    DenseMap<ResourceKey, std::vector<std::string>> NamesByKey;
+    std::atomic<unsigned> Hits{0};
+    std::atomic<unsigned> Misses{0};
+
+  public:
+    unsigned getNumHits() const
+    {
+        return Hits;
+    }
+
+    unsigned getNumMisses() const
+    {
+        return Misses;
+    }
+
+    std::optional<ExecutorSymbolDef> find(StringRef Name)
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto It = Symbols.find(Name);
+        if (It == Symbols.end())
+        {
+            ++Misses;
+            return std::nullopt;
+        }
+        ++Hits;
+        return It->second;
+    }
+
+    void insert(StringRef Name, const ExecutorSymbolDef &Sym)
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        Symbols[Name] = Sym;
+    }
+
+    /// track - Names are defined by a module added under the tracker with
+    /// key K.
+    void track(ResourceKey K, ArrayRef<std::string> Names)
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto &Tracked = NamesByKey[K];
+        Tracked.insert(Tracked.end(), Names.begin(), Names.end());
+    }
+
+    Error handleRemoveResources(JITDylib &JD, ResourceKey K) override
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto It = NamesByKey.find(K);
+        if (It == NamesByKey.end())
+            return Error::success();
+        for (const std::string &Name : It->second)
+            Symbols.erase(Name);
+        NamesByKey.erase(It);
+        return Error::success();
+    }
+
+    void handleTransferResources(JITDylib &JD, ResourceKey DstK, ResourceKey SrcK) override
+    {
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto It = NamesByKey.find(SrcK);
+        if (It == NamesByKey.end())
+            return;
+        std::vector<std::string> Names = std::move(It->second);
+        NamesByKey.erase(It);
+        auto &Tracked = NamesByKey[DstK];
+        Tracked.insert(Tracked.end(), Names.begin(), Names.end());
+    }
+};
+
+/// CompileMode - When the functions given to the JIT are optimized, and how.
+enum class CompileMode
+{
+    Eager,  // Optimized by the front end, compiled as they are looked up.
+    Lazy,   // Optimized and compiled on their first call.
+    Tiered, // Compiled quickly at first, and again at -O3 once they get hot.
+};
+
 class KaleidoscopeJIT
 {
   private:
+    /// TieredFunction - A function compiled at tier 0, with the count of its
+    /// calls and loop iterations so far, and the IR to recompile it from.
+    /// Name is what callers call and the bitcode defines, Impl the name of
+    /// this definition's body, and RT the tracker its code is added under.
+    struct TieredFunction
+    {
+        KaleidoscopeJIT *JIT;
+        std::string Name;
+        std::string Impl;
+        std::shared_ptr<const SmallVector<char, 0>> Bitcode;
+        ResourceTrackerSP RT;
+        std::atomic<uint64_t> Count{0};
+        bool Replaced = false; // Redefined since; guarded by StubLock.
+
+        TieredFunction(KaleidoscopeJIT *JIT, std::string Name, std::string Impl,
+                       std::shared_ptr<const SmallVector<char, 0>> Bitcode, ResourceTrackerSP RT)
+            : JIT(JIT), Name(std::move(Name)), Impl(std::move(Impl)), Bitcode(std::move(Bitcode)), RT(std::move(RT))
+        {
+        }
+    };
+
     std::unique_ptr<ExecutionSession> ES;
+    std::unique_ptr<EPCIndirectionUtils> EPCIU;
+    std::unique_ptr<TargetMachine> TM;
 
     DataLayout DL;
     MangleAndInterner Mangle;
 
-    RTDyldObjectLinkingLayer ObjectLayer;
+    // Objects compiled by CompileLayer, kept across processes.  Null unless a
+    // cache directory was given.  Tier 0 code counts its calls in this
+    // process's memory, so it is never cached.
+    std::unique_ptr<JITObjectCache> ObjCache;
+
+    // Every object is linked by JITLink into one slab of reserved address
+    // space, so small modules share pages instead of each getting its own.
+    LinkStatsPlugin *LinkStats = nullptr;
+    ObjectLinkingLayer ObjectLayer;
     IRCompileLayer CompileLayer;
+    IRCompileLayer Tier0CompileLayer;
+    IRTransformLayer TransformLayer;
+    IRTransformLayer Tier0TransformLayer;
+    CompileOnDemandLayer CODLayer;
 
     JITDylib &MainJD;
 
+    // Lazy mode adds modules to CODLayer, which only optimizes and compiles
+    // each function the first time it is called, through a stub.  Tiered mode
+    // adds them to Tier0TransformLayer, to be compiled quickly on their first
+    // call, and recompiles the hot ones on TierUpThread.  Otherwise modules
+    // arrive optimized and go straight to TransformLayer.
+    CompileMode Mode;
+    std::atomic<unsigned> NumFunctionsCompiled{0};
+
+    // Every function callers can name is called through a stub in Stubs,
+    // which points at the body of its latest definition.  Bodies are named
+    // Name$<generation>, and each definition's module has a tracker of its
+    // own, removed once all the functions it defined have been redefined.
+    std::unique_ptr<IndirectStubsManager> Stubs;
+    std::mutex StubLock;
+    std::map<std::string, unsigned> Generations;
+    std::map<std::string, ResourceTrackerSP> Definitions;
+    unsigned NumRedefinitions = 0;
+
+    uint64_t TierUpThreshold;
+    std::vector<std::unique_ptr<TieredFunction>> TieredFunctions;
+    std::mutex TierUpLock;
+    std::condition_variable TierUpReady;
+    std::deque<TieredFunction *> TierUpQueue;
+    bool ShuttingDown = false;
+    std::thread TierUpThread;
+    std::atomic<unsigned> NumTier0Functions{0};
+    std::atomic<unsigned> NumTierUps{0};
+
+    SymbolAddressCache Addresses;
+
+    // Eager mode compiles each module as it is added: on the compile threads
+    // if there are any, while later ones are parsed, and otherwise there and
+    // then.
+    unsigned CompileThreads;
+    std::mutex BackgroundLock;
+    std::condition_variable BackgroundIdle;
+    unsigned BackgroundCompiles = 0;
+    std::atomic<unsigned> NumBackgroundCompiles{0};
+
   public:
-    KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES, JITTargetMachineBuilder JTMB, DataLayout DL)
-        : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-          ObjectLayer(*this->ES, []() { return std::make_unique<SectionMemoryManager>(); }),
-          CompileLayer(*this->ES, ObjectLayer, std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-          MainJD(this->ES->createBareJITDylib("<main>"))
+    KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES, std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                    JITTargetMachineBuilder JTMB, JITTargetMachineBuilder Tier0JTMB, std::unique_ptr<TargetMachine> TM,
+                    DataLayout DL, CompileMode Mode, uint64_t TierUpThreshold, unsigned CompileThreads,
+                    std::unique_ptr<JITObjectCache> ObjCache,
+                    std::unique_ptr<jitlink::JITLinkMemoryManager> MemMgr)
+        : ES(std::move(ES)), EPCIU(std::move(EPCIU)), TM(std::move(TM)), DL(std::move(DL)),
+          Mangle(*this->ES, this->DL), ObjCache(std::move(ObjCache)),
+          ObjectLayer(*this->ES, std::move(MemMgr)),
+          CompileLayer(*this->ES, ObjectLayer,
+                       std::make_unique<ConcurrentIRCompiler>(std::move(JTMB), this->ObjCache.get())),
+          Tier0CompileLayer(*this->ES, ObjectLayer,
+                            std::make_unique<ConcurrentIRCompiler>(std::move(Tier0JTMB))),
+          TransformLayer(*this->ES, CompileLayer,
+                         [this](ThreadSafeModule TSM, const MaterializationResponsibility &) {
+                             return transformModule(std::move(TSM));
+                         }),
+          Tier0TransformLayer(*this->ES, Tier0CompileLayer,
+                              [this](ThreadSafeModule TSM, const MaterializationResponsibility &) {
+                                  return transformTier0Module(std::move(TSM));
+                              }),
+          CODLayer(*this->ES, TransformLayer, this->EPCIU->getLazyCallThroughManager(),
+                   [this] { return this->EPCIU->createIndirectStubsManager(); }),
+          MainJD(this->ES->createBareJITDylib("<main>")), Mode(Mode), TierUpThreshold(TierUpThreshold),
+          CompileThreads(CompileThreads)
     {
         MainJD.addGenerator(cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
-        if (JTMB.getTargetTriple().isOSBinFormatCOFF())
-        {
-            ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-            ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
-        }
+        auto Stats = std::make_unique<LinkStatsPlugin>();
+        LinkStats = Stats.get();
+        ObjectLayer.addPlugin(std::move(Stats));
+        this->ES->registerResourceManager(Addresses);
+        Stubs = this->EPCIU->createIndirectStubsManager();
+        if (Mode == CompileMode::Tiered)
+            TierUpThread = std::thread([this] { tierUpLoop(); });
     }
 
     ~KaleidoscopeJIT()
     {
+        // Hot functions still waiting to be recompiled never will be.
+        if (TierUpThread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> Guard(TierUpLock);
+                ShuttingDown = true;
+            }
+            TierUpReady.notify_one();
+            TierUpThread.join();
+        }
+        waitForBackgroundCompiles();
         if (auto Err = ES->endSession())
             ES->reportError(std::move(Err));
+        ES->deregisterResourceManager(Addresses);
+        if (auto Err = EPCIU->cleanup())
+            ES->reportError(std::move(Err));
     }
 
-    static Expected<std::unique_ptr<KaleidoscopeJIT>> Create()
+    /// Create - Build a JIT.  With an ObjectCacheDir, compiled objects are
+    /// kept there, up to ObjectCacheMaxBytes of them, and reused by later
+    /// processes.  Linked code goes into slabs of SlabSize bytes of address
+    /// space, reserved as they are needed.  Code is compiled for the host CPU
+    /// and its features, unless CPU is given, which replaces both; Features
+    /// ("+avx2,-fma") then adjusts what is enabled.
+    static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(CompileMode Mode = CompileMode::Eager,
+                                                             uint64_t TierUpThreshold = 0, unsigned CompileThreads = 0,
+                                                             StringRef ObjectCacheDir = "",
+                                                             uint64_t ObjectCacheMaxBytes = 0,
+                                                             size_t SlabSize = 64 << 20, StringRef CPU = "",
+                                                             StringRef Features = "")
     {
-        auto EPC = SelfExecutorProcessControl::Create();
+        // Without compile threads, code is compiled on whichever thread first
+        // looks it up.
+        std::unique_ptr<TaskDispatcher> Dispatcher;
+        if (CompileThreads)
+            Dispatcher = std::make_unique<ThreadPoolTaskDispatcher>(CompileThreads);
+        else
+            Dispatcher = std::make_unique<InPlaceTaskDispatcher>();
+        auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(Dispatcher));
         if (!EPC)
             return EPC.takeError();
 
         auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-        JITTargetMachineBuilder JTMB(ES->getExecutorProcessControl().getTargetTriple());
+        // Stubs and the reentry path that compiles a function on its first
+        // call.
+        auto EPCIU = EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+        if (!EPCIU)
+            return EPCIU.takeError();
+        (*EPCIU)->createLazyCallThroughManager(*ES, ExecutorAddr::fromPtr(&handleLazyCallThroughError));
+        if (auto Err = setUpInProcessLCTMReentryViaEPCIU(**EPCIU))
+            return std::move(Err);
 
-        auto DL = JTMB.getDefaultDataLayoutForTarget();
+        // Target the host CPU, so that its vector extensions are used, unless
+        // the same code is wanted wherever it runs.
+        auto JTMB = JITTargetMachineBuilder::detectHost();
+        if (!JTMB)
+            return JTMB.takeError();
+        if (!CPU.empty())
+        {
+            JTMB->setCPU(CPU.str());
+            JTMB->getFeatures() = SubtargetFeatures();
+        }
+        SmallVector<StringRef, 8> ExtraFeatures;
+        Features.split(ExtraFeatures, ',', -1, false);
+        for (StringRef Feature : ExtraFeatures)
+            JTMB->getFeatures().AddFeature(Feature.trim());
+
+        auto DL = JTMB->getDefaultDataLayoutForTarget();
         if (!DL)
             return DL.takeError();
 
-        return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB), std::move(*DL));
+        auto TM = JTMB->createTargetMachine();
+        if (!TM)
+            return TM.takeError();
+
+        // Tier 0 code is compiled as fast as possible, and what replaces it as
+        // well as possible.
+        JITTargetMachineBuilder Tier0JTMB = *JTMB;
+        Tier0JTMB.setCodeGenOptLevel(CodeGenOptLevel::None);
+        Tier0JTMB.getOptions().EnableFastISel = true;
+        if (Mode == CompileMode::Tiered)
+            JTMB->setCodeGenOptLevel(CodeGenOptLevel::Aggressive);
+
+        auto MemMgr = MapperJITLinkMemoryManager::CreateWithMapper<InProcessMemoryMapper>(
+            alignTo(SlabSize, sys::Process::getPageSizeEstimate()));
+        if (!MemMgr)
+            return MemMgr.takeError();
+
+        std::unique_ptr<JITObjectCache> ObjCache;
+        if (!ObjectCacheDir.empty())
+        {
+            auto Cache = JITObjectCache::Create(ObjectCacheDir, *JTMB, ObjectCacheMaxBytes);
+            if (!Cache)
+                return Cache.takeError();
+            ObjCache = std::move(*Cache);
+        }
+
+        return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*EPCIU), std::move(*JTMB),
+                                                 std::move(Tier0JTMB), std::move(*TM), std::move(*DL), Mode,
+                                                 TierUpThreshold, CompileThreads, std::move(ObjCache),
+                                                 std::move(*MemMgr));
     }
 
     const DataLayout &getDataLayout() const
@@ -77,22 +735,526 @@ class KaleidoscopeJIT
         return DL;
     }
 
+    /// getTargetMachine - A target machine like the one code is compiled with,
+    /// for target-aware IR optimizations such as vectorization.
+    TargetMachine &getTargetMachine() const
+    {
+        return *TM;
+    }
+
     JITDylib &getMainJITDylib()
     {
         return MainJD;
     }
 
+    /// getNumFunctionsCompiled - How many function bodies have been handed to
+    /// the optimizing compiler so far.  In lazy mode, only the ones that were
+    /// called, and in tiered mode, only the hot ones.
+    unsigned getNumFunctionsCompiled() const
+    {
+        return NumFunctionsCompiled;
+    }
+
+    /// getNumTier0Functions - How many function bodies have been compiled at
+    /// tier 0.
+    unsigned getNumTier0Functions() const
+    {
+        return NumTier0Functions;
+    }
+
+    /// getNumTierUps - How many hot functions have been recompiled at -O3 and
+    /// swapped in.
+    unsigned getNumTierUps() const
+    {
+        return NumTierUps;
+    }
+
+    /// getNumBackgroundCompiles - How many modules have been compiled in the
+    /// background as soon as they were added.
+    unsigned getNumBackgroundCompiles() const
+    {
+        return NumBackgroundCompiles;
+    }
+
+    /// getNumRedefinitions - How many functions have had their stub repointed
+    /// at a new definition.
+    unsigned getNumRedefinitions() const
+    {
+        return NumRedefinitions;
+    }
+
+    /// getNumObjectCacheHits - How many modules were loaded from the object
+    /// cache instead of being compiled.
+    unsigned getNumObjectCacheHits() const
+    {
+        return ObjCache ? ObjCache->getNumHits() : 0;
+    }
+
+    /// getNumObjectCacheMisses - How many modules were compiled, and then
+    /// cached, because the object cache didn't have them.
+    unsigned getNumObjectCacheMisses() const
+    {
+        return ObjCache ? ObjCache->getNumMisses() : 0;
+    }
+
+    /// getLinkStats - How much linking has been done, how fast, and how
+    /// densely it has packed code into memory.
+    LinkStatsPlugin &getLinkStats()
+    {
+        return *LinkStats;
+    }
+
+    /// waitForBackgroundCompiles - Block until every module compiling in the
+    /// background is done.
+    void waitForBackgroundCompiles()
+    {
+        std::unique_lock<std::mutex> Guard(BackgroundLock);
+        BackgroundIdle.wait(Guard, [this] { return BackgroundCompiles == 0; });
+    }
+
+    /// addModule - Add TSM to the JIT.  A module with a tracker of its own is
+    /// run once and removed, so it is compiled optimized right away: it gets
+    /// no second chance, and CODLayer moves function bodies into a dylib that
+    /// removing the tracker doesn't reach.  Nor is it worth caching on disk.
+    /// Any other module holds
+    /// definitions, which may replace earlier ones of the same names.
     Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr)
     {
-        if (!RT)
-            RT = MainJD.getDefaultResourceTracker();
-        return CompileLayer.add(RT, std::move(TSM));
+        if (RT)
+        {
+            TSM.withModuleDo([](Module &M) { JITObjectCache::exclude(M); });
+            Addresses.track(RT->getKeyUnsafe(), getDefinedNames(TSM));
+            return TransformLayer.add(RT, std::move(TSM));
+        }
+        return addDefinitions(std::move(TSM));
     }
 
+    /// lookup - Find Name's address, in the address cache if it was looked up
+    /// before.  A function's address is that of its stub, so it stays valid
+    /// when the function is redefined.
     Expected<ExecutorSymbolDef> lookup(StringRef Name)
+    {
+        // Whatever is looked up here is about to run, and must not call a
+        // stub still waiting for its body to be compiled in the background.
+        waitForBackgroundCompiles();
+        if (auto Sym = Addresses.find(Name))
+            return *Sym;
+        auto Sym = findSymbol(Name);
+        if (Sym)
+            Addresses.insert(Name, *Sym);
+        return Sym;
+    }
+
+    /// getFunction - Look up function Name once and return it as an FnT *,
+    /// e.g. getFunction<double(double, double)>("f"), to call as often as
+    /// needed.  The pointer is good until the tracker that defined Name is
+    /// removed; for a definition, that is never.
+    template <typename FnT> Expected<FnT *> getFunction(StringRef Name)
+    {
+        auto Sym = lookup(Name);
+        if (!Sym)
+            return Sym.takeError();
+        return Sym->getAddress().template toPtr<FnT *>();
+    }
+
+    /// getNumAddressCacheHits - How many lookups the address cache answered.
+    unsigned getNumAddressCacheHits() const
+    {
+        return Addresses.getNumHits();
+    }
+
+    /// getNumAddressCacheMisses - How many lookups went to the session.
+    unsigned getNumAddressCacheMisses() const
+    {
+        return Addresses.getNumMisses();
+    }
+
+  private:
+    /// findSymbol - Look Name up in the session, bypassing the address cache.
+    /// For symbols that are looked up once, or that the cache doesn't know
+    /// the tracker of.
+    Expected<ExecutorSymbolDef> findSymbol(StringRef Name)
     {
         return ES->lookup({&MainJD}, Mangle(Name.str()));
     }
+
+    /// getDefinedNames - The names of the symbols TSM defines.
+    static std::vector<std::string> getDefinedNames(ThreadSafeModule &TSM)
+    {
+        std::vector<std::string> Names;
+        TSM.withModuleDo([&](Module &M) {
+            for (GlobalValue &GV : M.global_values())
+                if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+                    Names.push_back(GV.getName().str());
+        });
+        return Names;
+    }
+
+    /// compileInBackground - Look Names up without waiting for them, which
+    /// sets the compile threads to work on the code that defines them.  Once
+    /// that is done, the stub of each Name in Repoint is aimed at its Impl,
+    /// unless the definition added under RT has been replaced by then.
+    void compileInBackground(SymbolLookupSet Names, ResourceTrackerSP RT,
+                             std::vector<std::pair<std::string, std::string>> Repoint)
+    {
+        {
+            std::lock_guard<std::mutex> Guard(BackgroundLock);
+            ++BackgroundCompiles;
+        }
+        ES->lookup(
+            LookupKind::Static, makeJITDylibSearchOrder(&MainJD), std::move(Names), SymbolState::Ready,
+            [this, RT = std::move(RT), Repoint = std::move(Repoint)](Expected<SymbolMap> Result) {
+                if (Result)
+                {
+                    ++NumBackgroundCompiles;
+                    std::lock_guard<std::mutex> Guard(StubLock);
+                    for (auto &[Name, Impl] : Repoint)
+                        if (Definitions[Name] == RT)
+                            if (auto Err = Stubs->updatePointer(*Mangle(Name), (*Result)[Mangle(Impl)].getAddress()))
+                                ES->reportError(std::move(Err));
+                }
+                else
+                    ES->reportError(Result.takeError());
+                std::lock_guard<std::mutex> Guard(BackgroundLock);
+                if (--BackgroundCompiles == 0)
+                    BackgroundIdle.notify_all();
+            },
+            NoDependenciesToRegister);
+    }
+
+    /// passesWideVectors - Whether F takes vectors wider than the 128 bits of
+    /// each vector register that the call-through path to a lazily compiled
+    /// function preserves.  Such functions have to be compiled up front.
+    static bool passesWideVectors(const Function &F)
+    {
+        for (const Argument &Arg : F.args())
+            if (Arg.getType()->isVectorTy() && Arg.getType()->getPrimitiveSizeInBits() > 128)
+                return true;
+        return false;
+    }
+
+    /// transformModule - The transform every module goes through just before
+    /// the optimizing compiler.  Unless the front end optimized it already,
+    /// this is where it is optimized.
+    Expected<ThreadSafeModule> transformModule(ThreadSafeModule TSM)
+    {
+        TSM.withModuleDo([this](Module &M) {
+            if (Mode != CompileMode::Eager)
+                optimizeModule(M);
+            for (Function &F : M)
+                if (!F.isDeclaration())
+                    ++NumFunctionsCompiled;
+        });
+        return std::move(TSM);
+    }
+
+    /// optimizeModule - Run the -O3 pipeline over M.  Every call has its own
+    /// pass and analysis managers, since functions called for the first time
+    /// on different threads are materialized concurrently.
+    void optimizeModule(Module &M)
+    {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PassBuilder PB(TM.get());
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3).run(M, MAM);
+    }
+
+    /// addDefinitions - Add the functions TSM defines, each under the name of
+    /// its body and behind a stub with its own name, which callers call.  A
+    /// function defined before has its stub repointed at the new body, and
+    /// the module of the old one is removed once nothing else in it is live.
+    /// Calls already running the old code finish there.
+    Error addDefinitions(ThreadSafeModule TSM)
+    {
+        ResourceTrackerSP RT = MainJD.createResourceTracker();
+        bool Wide = false;
+        std::vector<std::pair<std::string, std::string>> Defs; // Name, Impl.
+        std::vector<std::string> StubNow;
+        std::vector<TieredFunction *> Tiered;
+        SymbolLookupSet Background;
+        TSM.withModuleDo([&](Module &M) {
+            Wide = any_of(M, passesWideVectors);
+
+            // Recompiling starts over from the IR as it came in.
+            std::shared_ptr<const SmallVector<char, 0>> Bitcode;
+            if (Mode == CompileMode::Tiered)
+            {
+                auto Buffer = std::make_shared<SmallVector<char, 0>>();
+                raw_svector_ostream OS(*Buffer);
+                WriteBitcodeToFile(M, OS);
+                Bitcode = std::move(Buffer);
+            }
+
+            for (GlobalValue &GV : M.global_values())
+                if (!GV.isDeclaration() && !GV.hasLocalLinkage() && !isa<Function>(GV))
+                    Background.add(Mangle(GV.getName()));
+
+            std::vector<Function *> Fns;
+            for (Function &F : M)
+                if (!F.isDeclaration() && !F.hasLocalLinkage())
+                    Fns.push_back(&F);
+            for (Function *F : Fns)
+            {
+                std::string Name = F->getName().str();
+                std::string Impl = Name + "$" + std::to_string(++Generations[Name]);
+                Defs.push_back({Name, Impl});
+
+                // Only tier 0 code is compiled on the first call, through
+                // the lazy call-through path, which points the stub at the
+                // body then.  That path only preserves the low 128 bits of
+                // each vector register, so functions passing wider vectors
+                // get a stub aimed at their body now.  So does everything
+                // in eager mode, and in lazy mode, where the body is a stub
+                // of CODLayer's anyway.
+                if (Mode != CompileMode::Tiered || passesWideVectors(*F))
+                    StubNow.push_back(Name);
+
+                // Tiered code calls even itself through the stub, so that
+                // the next call after a swap runs the new code.
+                if (Mode == CompileMode::Tiered)
+                {
+                    Function *Stub = Function::Create(F->getFunctionType(), Function::ExternalLinkage, "", M);
+                    Stub->copyAttributesFrom(F);
+                    F->replaceAllUsesWith(Stub);
+                    Stub->takeName(F);
+                    TieredFunctions.push_back(std::make_unique<TieredFunction>(this, Name, Impl, Bitcode, RT));
+                    Tiered.push_back(TieredFunctions.back().get());
+                }
+                F->setName(Impl);
+                Background.add(Mangle(Impl));
+            }
+
+            if (Mode == CompileMode::Tiered)
+                instrumentTier0Module(M, Tiered);
+        });
+        Addresses.track(RT->getKeyUnsafe(), getDefinedNames(TSM));
+
+        IRLayer &Layer = Mode == CompileMode::Lazy && !Wide ? static_cast<IRLayer &>(CODLayer)
+                         : Mode == CompileMode::Tiered      ? static_cast<IRLayer &>(Tier0TransformLayer)
+                                                            : static_cast<IRLayer &>(TransformLayer);
+        if (auto Err = Layer.add(RT, std::move(TSM)))
+            return Err;
+
+        // A new tier 0 function's body isn't compiled until its stub is
+        // first called.  Stubs aimed at their body now are defined before
+        // it is compiled, since it may call itself through one.  With
+        // compile threads, eager mode aims a new function's stub once its
+        // body has been compiled in the background.
+        auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+        SymbolAliasMap Aliases;
+        SymbolMap StubSymbols;
+        std::vector<std::pair<std::string, std::string>> Repoint, RepointLater;
+        for (auto &[Name, Impl] : Defs)
+        {
+            if (!Definitions.count(Name))
+            {
+                if (!is_contained(StubNow, Name))
+                {
+                    Aliases[Mangle(Name)] = {Mangle(Impl), Flags};
+                    continue;
+                }
+                if (auto Err = Stubs->createStub(*Mangle(Name), ExecutorAddr(), Flags))
+                    return Err;
+                StubSymbols[Mangle(Name)] = Stubs->findStub(*Mangle(Name), true);
+                if (Mode == CompileMode::Eager && CompileThreads)
+                {
+                    RepointLater.push_back({Name, Impl});
+                    continue;
+                }
+            }
+            Repoint.push_back({Name, Impl});
+        }
+        if (auto Err = MainJD.define(absoluteSymbols(std::move(StubSymbols))))
+            return Err;
+        if (!Aliases.empty())
+            if (auto Err = MainJD.define(lazyReexports(EPCIU->getLazyCallThroughManager(), *Stubs, MainJD,
+                                                       std::move(Aliases))))
+                return Err;
+
+        // A redefined function's old stub only exists once something has
+        // looked it up.
+        std::vector<ExecutorAddr> Targets;
+        for (auto &[Name, Impl] : Repoint)
+        {
+            if (auto Stub = findSymbol(Name); !Stub)
+                return Stub.takeError();
+            auto Sym = findSymbol(Impl);
+            if (!Sym)
+                return Sym.takeError();
+            Targets.push_back(Sym->getAddress());
+        }
+
+        std::vector<ResourceTrackerSP> Retired;
+        {
+            std::lock_guard<std::mutex> Guard(StubLock);
+            for (size_t i = 0; i != Repoint.size(); ++i)
+            {
+                const std::string &Name = Repoint[i].first;
+                if (auto Err = Stubs->updatePointer(*Mangle(Name), Targets[i]))
+                    return Err;
+                auto Old = Definitions.find(Name);
+                if (Old == Definitions.end())
+                    continue;
+                for (auto &TF : TieredFunctions)
+                    if (TF->Name == Name && TF->RT == Old->second)
+                        TF->Replaced = true;
+                ++NumRedefinitions;
+            }
+            for (auto &[Name, Impl] : Defs)
+            {
+                ResourceTrackerSP Old = std::exchange(Definitions[Name], RT);
+                if (Old && Old != RT && !is_contained(Retired, Old) &&
+                    none_of(Definitions, [&](auto &Def) { return Def.second == Old; }))
+                    Retired.push_back(Old);
+            }
+        }
+        // Don't pull code out from under a compile still looking it up.
+        if (!Retired.empty())
+            waitForBackgroundCompiles();
+        for (ResourceTrackerSP &Old : Retired)
+            if (auto Err = Old->remove())
+                return Err;
+
+        if (Mode == CompileMode::Eager && CompileThreads)
+            compileInBackground(std::move(Background), RT, std::move(RepointLater));
+        return Error::success();
+    }
+
+    /// transformTier0Module - The transform modules go through just before
+    /// the tier 0 compiler: promoting variables to registers, the one pass
+    /// worth its time before a quick compile.
+    Expected<ThreadSafeModule> transformTier0Module(ThreadSafeModule TSM)
+    {
+        TSM.withModuleDo([this](Module &M) {
+            FunctionAnalysisManager FAM;
+            PassBuilder PB(TM.get());
+            PB.registerFunctionAnalyses(FAM);
+            FunctionPassManager FPM;
+            FPM.addPass(PromotePass());
+            for (Function &F : M)
+                if (!F.isDeclaration())
+                {
+                    FPM.run(F, FAM);
+                    ++NumTier0Functions;
+                }
+        });
+        return std::move(TSM);
+    }
+
+    /// instrumentTier0Module - Count the calls and loop iterations of each
+    /// function in Tiered, defined in M.
+    void instrumentTier0Module(Module &M, ArrayRef<TieredFunction *> Tiered)
+    {
+        for (TieredFunction *TF : Tiered)
+        {
+            Function &F = *M.getFunction(TF->Impl);
+            SmallSetVector<Instruction *, 8> Counted;
+            BasicBlock::iterator Entry = F.getEntryBlock().begin();
+            while (isa<AllocaInst>(*Entry))
+                ++Entry;
+            Counted.insert(&*Entry);
+            DominatorTree DT(F);
+            LoopInfo LI(DT);
+            SmallVector<BasicBlock *, 4> Latches;
+            for (Loop *L : LI.getLoopsInPreorder())
+                L->getLoopLatches(Latches);
+            for (BasicBlock *Latch : Latches)
+                Counted.insert(Latch->getTerminator());
+            for (Instruction *I : Counted)
+                emitTierUpCheck(I, *TF);
+        }
+    }
+
+    /// emitTierUpCheck - Count one more call or iteration of TF before I, and
+    /// hand TF to tierUp when the count reaches the threshold.
+    void emitTierUpCheck(Instruction *I, TieredFunction &TF)
+    {
+        IRBuilder<> B(I);
+        Value *Count = B.CreateIntToPtr(B.getInt64(reinterpret_cast<uintptr_t>(&TF.Count)), B.getPtrTy());
+        Value *Old = B.CreateAtomicRMW(AtomicRMWInst::Add, Count, B.getInt64(1), MaybeAlign(8),
+                                       AtomicOrdering::Monotonic);
+        B.SetInsertPoint(SplitBlockAndInsertIfThen(B.CreateICmpEQ(Old, B.getInt64(TierUpThreshold)), I, false));
+        FunctionType *FT = FunctionType::get(B.getVoidTy(), {B.getPtrTy()}, false);
+        B.CreateCall(FT, B.CreateIntToPtr(B.getInt64(reinterpret_cast<uintptr_t>(&tierUp)), B.getPtrTy()),
+                     {B.CreateIntToPtr(B.getInt64(reinterpret_cast<uintptr_t>(&TF)), B.getPtrTy())});
+    }
+
+    /// tierUp - Called from tier 0 code, on whatever thread runs it, when TF
+    /// has got hot.
+    static void tierUp(TieredFunction *TF)
+    {
+        KaleidoscopeJIT &J = *TF->JIT;
+        {
+            std::lock_guard<std::mutex> Guard(J.TierUpLock);
+            J.TierUpQueue.push_back(TF);
+        }
+        J.TierUpReady.notify_one();
+    }
+
+    /// tierUpLoop - Recompile hot functions in the background, in the order
+    /// they got hot, until the JIT shuts down.
+    void tierUpLoop()
+    {
+        while (true)
+        {
+            TieredFunction *TF;
+            {
+                std::unique_lock<std::mutex> Guard(TierUpLock);
+                TierUpReady.wait(Guard, [this] { return ShuttingDown || !TierUpQueue.empty(); });
+                if (ShuttingDown)
+                    return;
+                TF = TierUpQueue.front();
+                TierUpQueue.pop_front();
+            }
+            if (auto Err = recompile(*TF))
+                ES->reportError(std::move(Err));
+        }
+    }
+
+    /// recompile - Compile TF's function again at -O3 and swap it in, unless
+    /// it has been redefined meanwhile.  Calls already running the tier 0
+    /// code finish there.
+    Error recompile(TieredFunction &TF)
+    {
+        auto Ctx = std::make_unique<LLVMContext>();
+        auto M = parseBitcodeFile(MemoryBufferRef(StringRef(TF.Bitcode->data(), TF.Bitcode->size()), TF.Name), *Ctx);
+        if (!M)
+            return M.takeError();
+
+        // Anything else defined alongside it keeps its own stub, and is only
+        // here to be inlined.
+        for (Function &F : **M)
+            if (!F.isDeclaration() && !F.hasLocalLinkage() && F.getName() != TF.Name)
+                F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+        (*M)->getFunction(TF.Name)->setName(TF.Impl + ".tier1");
+
+        // The tier 1 code goes with the definition, and is removed with it.
+        // A tracker removed meanwhile fails the add or the lookup.
+        auto Replaced = [&] {
+            std::lock_guard<std::mutex> Guard(StubLock);
+            return TF.Replaced;
+        };
+        if (auto Err = TransformLayer.add(TF.RT, ThreadSafeModule(std::move(*M), std::move(Ctx))))
+            return Replaced() ? (consumeError(std::move(Err)), Error::success()) : std::move(Err);
+        auto Sym = findSymbol(TF.Impl + ".tier1");
+        if (!Sym)
+            return Replaced() ? (consumeError(Sym.takeError()), Error::success()) : Sym.takeError();
+
+        std::lock_guard<std::mutex> Guard(StubLock);
+        if (TF.Replaced)
+            return Error::success();
+        if (auto Err = Stubs->updatePointer(*Mangle(TF.Name), Sym->getAddress()))
+            return Err;
+        ++NumTierUps;
+        return Error::success();
+    }
 };
 
 } // end namespace orc
@@ -1,38 +1,70 @@
 #include "../include/KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/Inliner.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimpleLoopUnswitch.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#endif
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -61,17 +93,41 @@ enum Token
     tok_else = -8,
     tok_for = -9,
     tok_in = -10,
+    tok_while = -22,
+    tok_break = -23,
+    tok_return = -24,
 
     // operators
     tok_binary = -11,
     tok_unary = -12,
 
     // var definition
-    tok_var = -13
+    tok_var = -13,
+
+    // two-character operators
+    tok_le = -14,
+    tok_ge = -15,
+    tok_eq = -16,
+    tok_ne = -17,
+    tok_and = -18,
+    tok_or = -19,
+
+    // function attributes
+    tok_tailrec = -20,
+    tok_memo = -27,
+    tok_multiversion = -28,
+
+    // records
+    tok_record = -21,
+
+    // module-level names
+    tok_const = -25,
+    tok_global = -26
 };
 
 static std::string IdentifierStr; // Filled in if tok_identifier
 static double NumVal;             // Filled in if tok_number
+static bool NumIsInt;             // Filled in if tok_number, true if there was no '.'
 
 /// gettok - Return the next token from standard input.
 static int gettok()
@@ -102,18 +158,45 @@ static int gettok()
             return tok_for;
         if (IdentifierStr == "in")
             return tok_in;
+        if (IdentifierStr == "while")
+            return tok_while;
+        if (IdentifierStr == "break")
+            return tok_break;
+        if (IdentifierStr == "return")
+            return tok_return;
         if (IdentifierStr == "binary")
             return tok_binary;
         if (IdentifierStr == "unary")
             return tok_unary;
         if (IdentifierStr == "var")
             return tok_var;
+        if (IdentifierStr == "tailrec")
+            return tok_tailrec;
+        if (IdentifierStr == "memo")
+            return tok_memo;
+        if (IdentifierStr == "multiversion")
+            return tok_multiversion;
+        if (IdentifierStr == "record")
+            return tok_record;
+        if (IdentifierStr == "const")
+            return tok_const;
+        if (IdentifierStr == "global")
+            return tok_global;
         return tok_identifier;
     }
 
     if (isdigit(LastChar) || LastChar == '.')
     { // Number: [0-9.]+
         std::string NumStr;
+        if (LastChar == '.')
+        {
+            // A '.' that doesn't start a number like ".5" selects a record
+            // field, as in "ps[i].x".
+            LastChar = getchar();
+            if (!isdigit(LastChar))
+                return '.';
+            NumStr = ".";
+        }
         do
         {
             NumStr += LastChar;
@@ -121,6 +204,7 @@ static int gettok()
         } while (isdigit(LastChar) || LastChar == '.');
 
         NumVal = strtod(NumStr.c_str(), nullptr);
+        NumIsInt = NumStr.find('.') == std::string::npos;
         return tok_number;
     }
 
@@ -139,9 +223,23 @@ static int gettok()
     if (LastChar == EOF)
         return tok_eof;
 
-    // Otherwise, just return the character as its ascii value.
+    // Otherwise, just return the character as its ascii value, unless it starts
+    // one of the two-character operators.
+    static const struct
+    {
+        char First, Second;
+        int Tok;
+    } TwoCharOps[] = {{'<', '=', tok_le}, {'>', '=', tok_ge}, {'=', '=', tok_eq},
+                      {'!', '=', tok_ne}, {'&', '&', tok_and}, {'|', '|', tok_or}};
+
     int ThisChar = LastChar;
     LastChar = getchar();
+    for (auto &Op : TwoCharOps)
+        if (ThisChar == Op.First && LastChar == Op.Second)
+        {
+            LastChar = getchar();
+            return Op.Tok;
+        }
     return ThisChar;
 }
 
@@ -152,43 +250,350 @@ static int gettok()
 namespace
 {
 
+/// ValueType - The static type of a Kaleidoscope value.  The scalar
+/// enumerators are ordered so that implicit conversions only ever go from a
+/// lower to a higher one: bool widens to int, and both widen to double.
+/// Arrays (of double) are references to runtime-allocated storage, and
+/// vectors are SIMD values of 2, 4 or 8 doubles; neither ever converts to or
+/// from anything else.
+enum class ValueType
+{
+    Bool,
+    Int,
+    Double,
+    Array,
+    Vec2,
+    Vec4,
+    Vec8,
+    // FirstRecord + N is a collection of the record type Records[N].
+    FirstRecord
+};
+
+static bool isScalar(ValueType T)
+{
+    return T <= ValueType::Double;
+}
+
+static bool isVector(ValueType T)
+{
+    return T >= ValueType::Vec2 && T <= ValueType::Vec8;
+}
+
+/// getVecWidth - The number of lanes of vector type T.
+static unsigned getVecWidth(ValueType T)
+{
+    assert(isVector(T) && "not a vector type");
+    return 2u << ((unsigned)T - (unsigned)ValueType::Vec2);
+}
+
+/// getVecType - The vector type with Width lanes, if there is one.
+static std::optional<ValueType> getVecType(unsigned Width)
+{
+    for (ValueType T : {ValueType::Vec2, ValueType::Vec4, ValueType::Vec8})
+        if (getVecWidth(T) == Width)
+            return T;
+    return std::nullopt;
+}
+
+/// RecordDecl - A record type, declared like "record Particle(x y id: int)".
+/// Fields are ints or doubles, so each one fills an 8-byte slot.
+struct RecordDecl
+{
+    std::string Name;
+    std::vector<std::string> Fields;
+    std::vector<ValueType> FieldTypes;
+    bool AoS = false;           // Lay collections out as array-of-structs.
+    std::string CollectionName; // The type name of collections, "Name[]".
+
+    /// getFieldIndex - The position of field Field, or -1 if there isn't one.
+    int getFieldIndex(const std::string &Field) const
+    {
+        auto It = std::find(Fields.begin(), Fields.end(), Field);
+        return It == Fields.end() ? -1 : It - Fields.begin();
+    }
+};
+
+/// Records - Every record type declared so far.  Declarations are never
+/// removed, so a record's index identifies it for the whole session.
+static std::vector<RecordDecl> Records;
+
+static bool isRecordCollection(ValueType T)
+{
+    return T >= ValueType::FirstRecord;
+}
+
+/// getRecord - The record type that collection type T holds.
+static const RecordDecl &getRecord(ValueType T)
+{
+    assert(isRecordCollection(T) && "not a collection of records");
+    return Records[(unsigned)T - (unsigned)ValueType::FirstRecord];
+}
+
+/// findRecordCollection - The type of collections of the record called Name,
+/// if there is one.
+static std::optional<ValueType> findRecordCollection(StringRef Name)
+{
+    for (unsigned i = 0, e = Records.size(); i != e; ++i)
+        if (Records[i].Name == Name)
+            return ValueType((unsigned)ValueType::FirstRecord + i);
+    return std::nullopt;
+}
+
+/// GlobalDecl - A module-level name bound by "const" or "global".  A const's
+/// value is folded into every use; a global lives in memory, defined in a
+/// module of its own.
+struct GlobalDecl
+{
+    ValueType Ty;
+    bool IsConst;
+    uint64_t Bits; // The initial value, as stored in memory.
+};
+
+/// Globals - Every const and global declared so far.
+static std::map<std::string, GlobalDecl> Globals;
+
+class ExprAST;
+
+/// TypeScope - The variables visible while inferring the types of a function
+/// body.  Each one points at the type slot of the node that binds it, so that
+/// assignments seen anywhere in the body can widen the binding's type.
+///
+/// Numbers are doubles unless an int is needed: a literal without a '.' or a
+/// var binding is an int only where its value counts a loop, indexes, sizes an
+/// array or is passed, assigned or returned as something declared int.  That
+/// need carries through arithmetic, an int loop's end condition and the arms
+/// of an if, but not into other conditions or arguments.  So that var
+/// bindings can be told apart by how they are used, the first fixpoint treats
+/// every such literal as an int and marks the bindings read where an int is
+/// needed; the second lets the rest become doubles.
+struct TypeScope
+{
+    struct Binding
+    {
+        ValueType *Ty;
+        bool Annotated;         // Annotated bindings never change type.
+        bool *IntUse = nullptr; // For var bindings, set if ever read as an int.
+    };
+
+    std::map<std::string, Binding> Vars;
+    bool Changed = false;
+    bool IntLiterals = true;          // Whether literals without a '.' are always ints.
+    bool IntReturn = false;           // Whether the function returns an int.
+    const ExprAST *IntExpr = nullptr; // The expression whose value must be an int.
+
+    /// inferInt - Infer the type of E, whose value must be an int.
+    ValueType inferInt(ExprAST &E);
+
+    /// inferLike - Infer the type of E, whose value is that of Parent, so it
+    /// must be an int if Parent's must.
+    ValueType inferLike(const ExprAST *Parent, ExprAST &E);
+
+    /// widen - Make Var's type at least T, unless it was annotated.
+    void widen(Binding &Var, ValueType T)
+    {
+        if (Var.Annotated || T <= *Var.Ty)
+            return;
+        *Var.Ty = T;
+        Changed = true;
+    }
+};
+
+/// FunctionEffects - The side effects a function body may have.  A default
+/// constructed summary describes a pure, terminating, non-recursive function;
+/// each flag is only ever set by ExprAST::collectEffects(), never cleared.
+struct FunctionEffects
+{
+    bool ReadsMemory = false;
+    bool WritesMemory = false;
+    bool MayUnwind = false;
+    bool MayNotReturn = false;
+    bool MayRecurse = false;
+    bool InaccessibleMemory = false; // Uses memory only the runtime sees, like a memo cache.
+
+    /// unknown - The summary for a callee we know nothing about.
+    static FunctionEffects unknown()
+    {
+        FunctionEffects FE;
+        FE.ReadsMemory = FE.WritesMemory = FE.MayUnwind = FE.MayNotReturn = FE.MayRecurse = true;
+        FE.InaccessibleMemory = true;
+        return FE;
+    }
+
+    void merge(const FunctionEffects &Other)
+    {
+        ReadsMemory |= Other.ReadsMemory;
+        WritesMemory |= Other.WritesMemory;
+        InaccessibleMemory |= Other.InaccessibleMemory;
+        MayUnwind |= Other.MayUnwind;
+        MayNotReturn |= Other.MayNotReturn;
+        MayRecurse |= Other.MayRecurse;
+    }
+
+    bool isPure() const
+    {
+        return !ReadsMemory && !WritesMemory;
+    }
+
+    /// isWithin - Whether every effect this summary allows, Other allows too.
+    bool isWithin(const FunctionEffects &Other) const
+    {
+        return (!ReadsMemory || Other.ReadsMemory) && (!WritesMemory || Other.WritesMemory) &&
+               (!InaccessibleMemory || Other.InaccessibleMemory) && (!MayUnwind || Other.MayUnwind) &&
+               (!MayNotReturn || Other.MayNotReturn) && (!MayRecurse || Other.MayRecurse);
+    }
+};
+
 /// ExprAST - Base class for all expression nodes.
 class ExprAST
 {
   public:
+    /// ExprKind - Discriminator for LLVM-style RTTI (isa<>, dyn_cast<>), since
+    /// we build without C++ RTTI like LLVM itself.
+    enum ExprKind
+    {
+        EK_Number,
+        EK_Variable,
+        EK_Unary,
+        EK_Binary,
+        EK_Call,
+        EK_Cast,
+        EK_Index,
+        EK_NewArray,
+        EK_Len,
+        EK_Vec,
+        EK_Shuffle,
+        EK_Reduce,
+        EK_If,
+        EK_For,
+        EK_ParallelFor,
+        EK_RangeReduce,
+        EK_While,
+        EK_Break,
+        EK_Return,
+        EK_Var
+    };
+
+  private:
+    const ExprKind Kind;
+
+  public:
+    ExprAST(ExprKind K) : Kind(K)
+    {
+    }
     virtual ~ExprAST() = default;
 
+    ExprKind getKind() const
+    {
+        return Kind;
+    }
+
     virtual Value *codegen() = 0;
+
+    /// codegenCond - Emit this expression as an i1 truth value for use as a
+    /// branch condition.  Expressions that are naturally boolean override this
+    /// so that no double ever has to be materialized and compared against 0.0.
+    virtual Value *codegenCond();
+
+    /// codegenReturn - Emit this expression in tail position: evaluate it and
+    /// return its value from the current function.  Expressions that can reach
+    /// a call in tail position override this to emit the return themselves.
+    /// Returns false on error.
+    virtual bool codegenReturn();
+
+    /// collectEffects - Merge the side effects of evaluating this expression
+    /// into FE.  Self is the name of the function whose body is analysed, so
+    /// that direct recursion can be told apart from calls to other functions.
+    virtual void collectEffects(const std::string &Self, FunctionEffects &FE) const = 0;
+
+    /// inferType - Return the type this expression evaluates to, widening the
+    /// types of unannotated bindings it assigns to along the way.
+    virtual ValueType inferType(TypeScope &Scope) = 0;
 };
 
+ValueType TypeScope::inferInt(ExprAST &E)
+{
+    const ExprAST *OldIntExpr = IntExpr;
+    IntExpr = &E;
+    ValueType Ty = E.inferType(*this);
+    IntExpr = OldIntExpr;
+    return Ty;
+}
+
+ValueType TypeScope::inferLike(const ExprAST *Parent, ExprAST &E)
+{
+    return IntExpr == Parent ? inferInt(E) : E.inferType(*this);
+}
+
 /// NumberExprAST - Expression class for numeric literals like "1.0".
 class NumberExprAST : public ExprAST
 {
     double Val;
+    ValueType Ty;
+    bool IntLiteral; // Written without a '.', so an int where one is needed.
 
   public:
-    NumberExprAST(double Val) : Val(Val)
+    NumberExprAST(double Val, ValueType Ty = ValueType::Double)
+        : ExprAST(EK_Number), Val(Val), Ty(Ty), IntLiteral(Ty == ValueType::Int)
     {
     }
 
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Number;
+    }
+
     Value *codegen() override;
+    void collectEffects(const std::string &, FunctionEffects &) const override
+    {
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        if (IntLiteral)
+            Ty = Scope.IntLiterals || Scope.IntExpr == this ? ValueType::Int : ValueType::Double;
+        return Ty;
+    }
+
+    double getValue() const
+    {
+        return Val;
+    }
+    ValueType getType() const
+    {
+        return Ty;
+    }
 };
 
 /// VariableExprAST - Expression class for referencing a variable, like "a".
 class VariableExprAST : public ExprAST
 {
     std::string Name;
+    const GlobalDecl *Global = nullptr; // Set by inferType unless Name is a local.
 
   public:
-    VariableExprAST(const std::string &Name) : Name(Name)
+    VariableExprAST(const std::string &Name) : ExprAST(EK_Variable), Name(Name)
+    {
+    }
+
+    static bool classof(const ExprAST *E)
     {
+        return E->getKind() == EK_Variable;
     }
 
     Value *codegen() override;
+    void collectEffects(const std::string &, FunctionEffects &FE) const override
+    {
+        if (Global && !Global->IsConst)
+            FE.ReadsMemory = true;
+    }
+    ValueType inferType(TypeScope &Scope) override;
     const std::string &getName() const
     {
         return Name;
     }
+    const GlobalDecl *getGlobal() const
+    {
+        return Global;
+    }
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
@@ -198,26 +603,98 @@ class UnaryExprAST : public ExprAST
     std::unique_ptr<ExprAST> Operand;
 
   public:
-    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand) : Opcode(Opcode), Operand(std::move(Operand))
+    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
+        : ExprAST(EK_Unary), Opcode(Opcode), Operand(std::move(Operand))
     {
     }
 
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Unary;
+    }
+
     Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override;
+    ValueType inferType(TypeScope &Scope) override;
 };
 
+/// isBooleanOp - Return true if the builtin binary operator Op yields a truth
+/// value rather than a number.
+static bool isBooleanOp(int Op)
+{
+    switch (Op)
+    {
+    case '<':
+    case '>':
+    case tok_le:
+    case tok_ge:
+    case tok_eq:
+    case tok_ne:
+    case tok_and:
+    case tok_or:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// isBuiltinBinop - Return true if Op is lowered natively rather than through a
+/// call to a user-defined "binary" function.
+static bool isBuiltinBinop(int Op)
+{
+    return Op == '=' || Op == '+' || Op == '-' || Op == '*' || Op == '/' || isBooleanOp(Op);
+}
+
+/// getBuiltinBinopType - The type a builtin arithmetic or boolean operator
+/// yields for operands of types L and R.  Arithmetic on bools happens in int,
+/// '/' is always true division, and vector operations are element-wise.
+static ValueType getBuiltinBinopType(int Op, ValueType L, ValueType R)
+{
+    if (isBooleanOp(Op))
+        return ValueType::Bool;
+    if (!isScalar(L) || !isScalar(R))
+        return std::max(L, R);
+    if (Op == '/')
+        return ValueType::Double;
+    return std::max({L, R, ValueType::Int});
+}
+
 /// BinaryExprAST - Expression class for a binary operator.
 class BinaryExprAST : public ExprAST
 {
-    char Op;
+    int Op; // An ASCII character or one of the two-character operator tokens.
     std::unique_ptr<ExprAST> LHS, RHS;
 
+    Value *codegenShortCircuit();
+
   public:
-    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-        : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS))
+    BinaryExprAST(int Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
+        : ExprAST(EK_Binary), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
     {
+        return E->getKind() == EK_Binary;
     }
 
     Value *codegen() override;
+    Value *codegenCond() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override;
+    ValueType inferType(TypeScope &Scope) override;
+
+    int getOp() const
+    {
+        return Op;
+    }
+    ExprAST &getLHS() const
+    {
+        return *LHS;
+    }
+    ExprAST &getRHS() const
+    {
+        return *RHS;
+    }
 };
 
 /// CallExprAST - Expression class for function calls.
@@ -228,1003 +705,4517 @@ class CallExprAST : public ExprAST
 
   public:
     CallExprAST(const std::string &Callee, std::vector<std::unique_ptr<ExprAST>> Args)
-        : Callee(Callee), Args(std::move(Args))
+        : ExprAST(EK_Call), Callee(Callee), Args(std::move(Args))
     {
     }
 
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Call;
+    }
+
     Value *codegen() override;
+    bool codegenReturn() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override;
+    ValueType inferType(TypeScope &Scope) override;
 };
 
-/// IfExprAST - Expression class for if/then/else.
-class IfExprAST : public ExprAST
+/// CastExprAST - Expression class for explicit conversions like "int(x)".
+class CastExprAST : public ExprAST
 {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
+    ValueType To;
+    std::unique_ptr<ExprAST> Operand;
 
   public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
-        : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else))
+    CastExprAST(ValueType To, std::unique_ptr<ExprAST> Operand)
+        : ExprAST(EK_Cast), To(To), Operand(std::move(Operand))
     {
     }
 
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Cast;
+    }
+
     Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        Operand->collectEffects(Self, FE);
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        Operand->inferType(Scope);
+        return To;
+    }
 };
 
-/// ForExprAST - Expression class for for/in.
-class ForExprAST : public ExprAST
+/// IndexExprAST - Expression class for array element or vector lane access,
+/// like "a[i]", and for fields of elements of record collections, like
+/// "ps[i].x".  Loads codegen through here; stores go through BinaryExprAST's
+/// '=' path.
+class IndexExprAST : public ExprAST
 {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
+    std::unique_ptr<ExprAST> Array, Index;
+    std::string Field;                    // Empty unless a record field.
+    ValueType AggType = ValueType::Array; // Type of Array, once inferred.
+
+    Value *codegenAddress(Value *Agg);
+    Value *codegenLaneIndex(ValueType VecTy);
+    ValueType getElementType(ValueType Ty) const;
 
   public:
-    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
-               std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
-        : VarName(VarName), Start(std::move(Start)), End(std::move(End)), Step(std::move(Step)), Body(std::move(Body))
+    IndexExprAST(std::unique_ptr<ExprAST> Array, std::unique_ptr<ExprAST> Index, std::string Field = "")
+        : ExprAST(EK_Index), Array(std::move(Array)), Index(std::move(Index)), Field(std::move(Field))
     {
     }
 
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Index;
+    }
+
     Value *codegen() override;
+    Value *codegenStore(Value *Val);
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        Array->collectEffects(Self, FE);
+        Index->collectEffects(Self, FE);
+        // Array elements live in memory, vector lanes don't.  A failed bounds
+        // check exits the program; constant lanes are checked at compile time.
+        if (!isVectorLane())
+            FE.ReadsMemory = true;
+        if (!isVectorLane() || !isa<NumberExprAST>(Index.get()))
+            FE.MayNotReturn = true;
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        AggType = Array->inferType(Scope);
+        Scope.inferInt(*Index);
+        return getElementType(AggType);
+    }
+
+    bool isVectorLane() const
+    {
+        return isVector(AggType);
+    }
 };
 
-/// VarExprAST - Expression class for var/in
-class VarExprAST : public ExprAST
+/// NewArrayExprAST - Expression class for allocating a zero-filled array, like
+/// "array(n)", or a collection of records, like "Particle[n]".
+class NewArrayExprAST : public ExprAST
 {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-    std::unique_ptr<ExprAST> Body;
+    ValueType Ty;
+    std::unique_ptr<ExprAST> Length;
 
   public:
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames, std::unique_ptr<ExprAST> Body)
-        : VarNames(std::move(VarNames)), Body(std::move(Body))
+    NewArrayExprAST(ValueType Ty, std::unique_ptr<ExprAST> Length)
+        : ExprAST(EK_NewArray), Ty(Ty), Length(std::move(Length))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
     {
+        return E->getKind() == EK_NewArray;
     }
 
     Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        Length->collectEffects(Self, FE);
+        // A negative length exits the program.
+        FE.ReadsMemory = FE.WritesMemory = FE.MayNotReturn = true;
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        Scope.inferInt(*Length);
+        return Ty;
+    }
 };
 
-/// PrototypeAST - This class represents the "prototype" for a function,
-/// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes), as well as if it is an operator.
-class PrototypeAST
+/// LenExprAST - Expression class for the length of an array or a collection of
+/// records, like "len(a)".
+class LenExprAST : public ExprAST
 {
-    std::string Name;
-    std::vector<std::string> Args;
-    bool IsOperator;
-    unsigned Precedence; // Precedence if a binary op.
+    std::unique_ptr<ExprAST> Array;
 
   public:
-    PrototypeAST(const std::string &Name, std::vector<std::string> Args, bool IsOperator = false, unsigned Prec = 0)
-        : Name(Name), Args(std::move(Args)), IsOperator(IsOperator), Precedence(Prec)
+    LenExprAST(std::unique_ptr<ExprAST> Array) : ExprAST(EK_Len), Array(std::move(Array))
     {
     }
 
-    Function *codegen();
-    const std::string &getName() const
+    static bool classof(const ExprAST *E)
     {
-        return Name;
+        return E->getKind() == EK_Len;
     }
 
-    bool isUnaryOp() const
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
     {
-        return IsOperator && Args.size() == 1;
+        Array->collectEffects(Self, FE);
+        FE.ReadsMemory = true;
     }
-    bool isBinaryOp() const
+    ValueType inferType(TypeScope &Scope) override
     {
-        return IsOperator && Args.size() == 2;
+        Array->inferType(Scope);
+        return ValueType::Int;
     }
+};
 
-    char getOperatorName() const
+/// VecExprAST - Expression class for vector literals like "vec4(a, b, c, d)",
+/// or "vec4(x)" for x in every lane.
+class VecExprAST : public ExprAST
+{
+    ValueType Ty;
+    std::vector<std::unique_ptr<ExprAST>> Lanes;
+
+  public:
+    VecExprAST(ValueType Ty, std::vector<std::unique_ptr<ExprAST>> Lanes)
+        : ExprAST(EK_Vec), Ty(Ty), Lanes(std::move(Lanes))
     {
-        assert(isUnaryOp() || isBinaryOp());
-        return Name[Name.size() - 1];
     }
 
-    unsigned getBinaryPrecedence() const
+    static bool classof(const ExprAST *E)
     {
-        return Precedence;
+        return E->getKind() == EK_Vec;
+    }
+
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        for (auto &Lane : Lanes)
+            Lane->collectEffects(Self, FE);
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        for (auto &Lane : Lanes)
+            Lane->inferType(Scope);
+        return Ty;
     }
 };
 
-/// FunctionAST - This class represents a function definition itself.
-class FunctionAST
+/// ShuffleExprAST - Expression class for rearranging the lanes of a vector,
+/// like "shuffle(v, 3, 2, 1, 0)".  The result has one lane per index.
+class ShuffleExprAST : public ExprAST
 {
-    std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    std::unique_ptr<ExprAST> Operand;
+    std::vector<int> Mask;
 
   public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
-        : Proto(std::move(Proto)), Body(std::move(Body))
+    ShuffleExprAST(std::unique_ptr<ExprAST> Operand, std::vector<int> Mask)
+        : ExprAST(EK_Shuffle), Operand(std::move(Operand)), Mask(std::move(Mask))
     {
     }
 
-    Function *codegen();
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Shuffle;
+    }
+
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        Operand->collectEffects(Self, FE);
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        Operand->inferType(Scope);
+        return *getVecType(Mask.size());
+    }
 };
 
-} // end anonymous namespace
+/// ReduceExprAST - Expression class for horizontal reductions of a vector:
+/// "hsum(v)", "hmin(v)" and "hmax(v)".
+class ReduceExprAST : public ExprAST
+{
+  public:
+    enum ReduceKind
+    {
+        RK_Sum,
+        RK_Min,
+        RK_Max
+    };
 
-//===----------------------------------------------------------------------===//
-// Parser
-//===----------------------------------------------------------------------===//
+  private:
+    ReduceKind Reduction;
+    std::unique_ptr<ExprAST> Operand;
 
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken()
-{
-    return CurTok = gettok();
-}
+  public:
+    ReduceExprAST(ReduceKind Reduction, std::unique_ptr<ExprAST> Operand)
+        : ExprAST(EK_Reduce), Reduction(Reduction), Operand(std::move(Operand))
+    {
+    }
 
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Reduce;
+    }
 
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence()
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        Operand->collectEffects(Self, FE);
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        Operand->inferType(Scope);
+        return ValueType::Double;
+    }
+};
+
+/// IfExprAST - Expression class for if/then/else.
+class IfExprAST : public ExprAST
 {
-    if (!isascii(CurTok))
-        return -1;
+    std::unique_ptr<ExprAST> Cond, Then, Else;
 
-    // Make sure it's a declared binop.
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0)
-        return -1;
-    return TokPrec;
+  public:
+    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
+        : ExprAST(EK_If), Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_If;
+    }
+
+    Value *codegen() override;
+    bool codegenReturn() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override;
+    ValueType inferType(TypeScope &Scope) override;
+};
+
+/// ForExprAST - Expression class for for/in.
+class ForExprAST : public ExprAST
+{
+    std::string VarName;
+    std::optional<ValueType> VarAnnotation;
+    ValueType VarType; // Inferred unless annotated.
+    std::unique_ptr<ExprAST> Start, End, Step, Body;
+
+  public:
+    ForExprAST(const std::string &VarName, std::optional<ValueType> VarAnnotation, std::unique_ptr<ExprAST> Start,
+               std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step, std::unique_ptr<ExprAST> Body)
+        : ExprAST(EK_For), VarName(VarName), VarAnnotation(VarAnnotation),
+          VarType(VarAnnotation.value_or(ValueType::Bool)), Start(std::move(Start)), End(std::move(End)),
+          Step(std::move(Step)), Body(std::move(Body))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_For;
+    }
+
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override;
+    ValueType inferType(TypeScope &Scope) override;
+};
+
+/// ParallelForExprAST - Expression class for "parallel for i = a, b in body",
+/// which runs body for i = a, a + 1, ..., b - 1 in chunks on the runtime's
+/// thread pool, in no particular order.  Iterations share the enclosing
+/// function's variables read-only.
+class ParallelForExprAST : public ExprAST
+{
+    std::string VarName;
+    ValueType VarType = ValueType::Int;
+    std::unique_ptr<ExprAST> Start, End, Body;
+
+    Function *emitChunk(StructType *EnvTy, const std::vector<std::pair<std::string, AllocaInst *>> &Captures);
+
+  public:
+    ParallelForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End,
+                       std::unique_ptr<ExprAST> Body)
+        : ExprAST(EK_ParallelFor), VarName(VarName), Start(std::move(Start)), End(std::move(End)),
+          Body(std::move(Body))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_ParallelFor;
+    }
+
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        Start->collectEffects(Self, FE);
+        End->collectEffects(Self, FE);
+        Body->collectEffects(Self, FE);
+
+        // The thread pool's queues are memory only the runtime sees.
+        FE.InaccessibleMemory = true;
+    }
+    ValueType inferType(TypeScope &Scope) override;
+};
+
+/// RangeReduceExprAST - Expression class for reductions over a range, like
+/// "sum i = a, b in expr", which folds expr over i = a, a + 1, ..., b - 1.
+/// The accumulator lives in a register and only the reduction itself may be
+/// reassociated, so the loop can be vectorized and unrolled with several
+/// partial results.
+class RangeReduceExprAST : public ExprAST
+{
+  public:
+    enum ReduceKind
+    {
+        RK_Sum,
+        RK_Prod,
+        RK_Min,
+        RK_Max
+    };
+
+  private:
+    ReduceKind Reduction;
+    std::string VarName;
+    std::optional<ValueType> VarAnnotation;
+    ValueType VarType; // Inferred unless annotated.
+    ValueType Ty;      // Of the result, inferred from the body.
+    std::unique_ptr<ExprAST> Start, End, Body;
+
+    Value *getIdentity() const;
+    Value *combine(Value *Acc, Value *V) const;
+
+  public:
+    RangeReduceExprAST(ReduceKind Reduction, const std::string &VarName, std::optional<ValueType> VarAnnotation,
+                       std::unique_ptr<ExprAST> Start, std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Body)
+        : ExprAST(EK_RangeReduce), Reduction(Reduction), VarName(VarName), VarAnnotation(VarAnnotation),
+          VarType(VarAnnotation.value_or(ValueType::Bool)), Ty(ValueType::Int), Start(std::move(Start)),
+          End(std::move(End)), Body(std::move(Body))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_RangeReduce;
+    }
+
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        // The variable the body sees is a copy of the counter, so an int
+        // counter always reaches the end.  A double one may not: it stops
+        // growing at 2^53, and the end may be infinite.
+        Start->collectEffects(Self, FE);
+        End->collectEffects(Self, FE);
+        Body->collectEffects(Self, FE);
+        if (VarType == ValueType::Double)
+            FE.MayNotReturn = true;
+    }
+    ValueType inferType(TypeScope &Scope) override;
+};
+
+/// WhileExprAST - Expression class for while/in.
+class WhileExprAST : public ExprAST
+{
+    std::unique_ptr<ExprAST> Cond, Body;
+
+  public:
+    WhileExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Body)
+        : ExprAST(EK_While), Cond(std::move(Cond)), Body(std::move(Body))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_While;
+    }
+
+    Value *codegen() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override;
+    ValueType inferType(TypeScope &Scope) override;
+};
+
+/// BreakExprAST - Expression class for "break", which leaves the innermost
+/// enclosing for or while loop.
+class BreakExprAST : public ExprAST
+{
+  public:
+    BreakExprAST() : ExprAST(EK_Break)
+    {
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Break;
+    }
+
+    Value *codegen() override;
+    void collectEffects(const std::string &, FunctionEffects &) const override
+    {
+    }
+    ValueType inferType(TypeScope &) override
+    {
+        // Never produces a value, so it doesn't widen an enclosing if.
+        return ValueType::Bool;
+    }
+};
+
+/// ReturnExprAST - Expression class for "return expr", which leaves the
+/// function early.
+class ReturnExprAST : public ExprAST
+{
+    std::unique_ptr<ExprAST> Val;
+
+  public:
+    ReturnExprAST(std::unique_ptr<ExprAST> Val) : ExprAST(EK_Return), Val(std::move(Val))
+    {
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Return;
+    }
+
+    Value *codegen() override;
+    bool codegenReturn() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override
+    {
+        Val->collectEffects(Self, FE);
+    }
+    ValueType inferType(TypeScope &Scope) override
+    {
+        if (Scope.IntReturn)
+            Scope.inferInt(*Val);
+        else
+            Val->inferType(Scope);
+        return ValueType::Bool;
+    }
+};
+
+/// VarExprAST - Expression class for var/in
+class VarExprAST : public ExprAST
+{
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    std::vector<std::optional<ValueType>> VarAnnotations;
+    std::vector<ValueType> VarTypes; // Inferred unless annotated.
+    std::deque<bool> IntUses;        // Whether each is ever read as an int.
+    std::unique_ptr<ExprAST> Body;
+
+    bool pushBindings(std::vector<AllocaInst *> &OldBindings);
+    void popBindings(const std::vector<AllocaInst *> &OldBindings);
+
+  public:
+    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
+               std::vector<std::optional<ValueType>> VarAnnotations, std::unique_ptr<ExprAST> Body)
+        : ExprAST(EK_Var), VarNames(std::move(VarNames)), VarAnnotations(std::move(VarAnnotations)),
+          Body(std::move(Body))
+    {
+        for (auto &Annotation : this->VarAnnotations)
+            VarTypes.push_back(Annotation.value_or(ValueType::Bool));
+        IntUses.resize(VarTypes.size());
+    }
+
+    static bool classof(const ExprAST *E)
+    {
+        return E->getKind() == EK_Var;
+    }
+
+    Value *codegen() override;
+    bool codegenReturn() override;
+    void collectEffects(const std::string &Self, FunctionEffects &FE) const override;
+    ValueType inferType(TypeScope &Scope) override;
+};
+
+/// PrototypeAST - This class represents the "prototype" for a function,
+/// which captures its name, and its argument names and types (thus implicitly
+/// the number of arguments the function takes), its return type, as well as if
+/// it is an operator.
+class PrototypeAST
+{
+    std::string Name;
+    std::vector<std::string> Args;
+    std::vector<ValueType> ArgTypes;
+    ValueType RetType;
+    bool IsOperator;
+    unsigned Precedence; // Precedence if a binary op.
+    bool TailRec = false; // Self calls must all become loops.
+    bool Memo = false;    // Calls go through a cache of earlier results.
+    bool MultiVersion = false; // Compiled per CPU feature level, picked at run time.
+
+    std::optional<FunctionEffects> Effects; // Unset if nothing is known.
+
+  public:
+    PrototypeAST(const std::string &Name, std::vector<std::string> Args, std::vector<ValueType> ArgTypes,
+                 ValueType RetType, bool IsOperator = false, unsigned Prec = 0)
+        : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)), RetType(RetType), IsOperator(IsOperator),
+          Precedence(Prec)
+    {
+    }
+
+    Function *codegen();
+    const std::string &getName() const
+    {
+        return Name;
+    }
+    const std::vector<std::string> &getArgs() const
+    {
+        return Args;
+    }
+    const std::vector<ValueType> &getArgTypes() const
+    {
+        return ArgTypes;
+    }
+    ValueType getReturnType() const
+    {
+        return RetType;
+    }
+
+    bool isUnaryOp() const
+    {
+        return IsOperator && Args.size() == 1;
+    }
+    bool isBinaryOp() const
+    {
+        return IsOperator && Args.size() == 2;
+    }
+
+    char getOperatorName() const
+    {
+        assert(isUnaryOp() || isBinaryOp());
+        return Name[Name.size() - 1];
+    }
+
+    unsigned getBinaryPrecedence() const
+    {
+        return Precedence;
+    }
+
+    bool isTailRec() const
+    {
+        return TailRec;
+    }
+    void setTailRec()
+    {
+        TailRec = true;
+    }
+
+    bool isMemo() const
+    {
+        return Memo;
+    }
+    void setMemo()
+    {
+        Memo = true;
+    }
+
+    bool isMultiVersion() const
+    {
+        return MultiVersion;
+    }
+    void setMultiVersion()
+    {
+        MultiVersion = true;
+    }
+
+    const std::optional<FunctionEffects> &getEffects() const
+    {
+        return Effects;
+    }
+    void setEffects(const FunctionEffects &FE)
+    {
+        Effects = FE;
+    }
+};
+
+/// FunctionAST - This class represents a function definition itself.
+class FunctionAST
+{
+    std::unique_ptr<PrototypeAST> Proto;
+    std::unique_ptr<ExprAST> Body;
+
+  public:
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
+        : Proto(std::move(Proto)), Body(std::move(Body))
+    {
+    }
+
+    Function *codegen();
+};
+
+/// GlobalAST - This class represents a "const" or "global" declaration.
+class GlobalAST
+{
+    std::string Name;
+    bool IsConst;
+    std::optional<ValueType> Annotation;
+    std::unique_ptr<ExprAST> Init;
+
+  public:
+    GlobalAST(const std::string &Name, bool IsConst, std::optional<ValueType> Annotation,
+              std::unique_ptr<ExprAST> Init)
+        : Name(Name), IsConst(IsConst), Annotation(Annotation), Init(std::move(Init))
+    {
+    }
+
+    const GlobalDecl *codegen();
+    const std::string &getName() const
+    {
+        return Name;
+    }
+};
+
+} // end anonymous namespace
+
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
+
+/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
+/// token the parser is looking at.  getNextToken reads another token from the
+/// lexer and updates CurTok with its results.
+static int CurTok;
+static int getNextToken()
+{
+    return CurTok = gettok();
+}
+
+/// BinopPrecedence - This holds the precedence for each binary operator that is
+/// defined.
+static std::map<int, int> BinopPrecedence;
+
+/// GetTokPrecedence - Get the precedence of the pending binary operator token.
+static int GetTokPrecedence()
+{
+    // Make sure it's a declared binop.
+    auto It = BinopPrecedence.find(CurTok);
+    if (It == BinopPrecedence.end() || It->second <= 0)
+        return -1;
+    return It->second;
+}
+
+/// LogError* - These are little helper functions for error handling.
+std::unique_ptr<ExprAST> LogError(const char *Str)
+{
+    fprintf(stderr, "Error: %s\n", Str);
+    return nullptr;
+}
+
+std::unique_ptr<PrototypeAST> LogErrorP(const char *Str)
+{
+    LogError(Str);
+    return nullptr;
+}
+
+static std::unique_ptr<ExprAST> ParseExpression();
+
+/// NativeVecType - The type "vec" stands for: the vector of doubles that fills
+/// one of the host's SIMD registers.  Set once the JIT is up.
+static ValueType NativeVecType = ValueType::Vec2;
+
+/// getTypeFromName - Map a type name to its ValueType, if it is one.
+static std::optional<ValueType> getTypeFromName(const std::string &Name)
+{
+    if (Name == "double")
+        return ValueType::Double;
+    if (Name == "int")
+        return ValueType::Int;
+    if (Name == "bool")
+        return ValueType::Bool;
+    if (Name == "array")
+        return ValueType::Array;
+    if (Name == "vec")
+        return NativeVecType;
+    if (Name == "vec2")
+        return ValueType::Vec2;
+    if (Name == "vec4")
+        return ValueType::Vec4;
+    if (Name == "vec8")
+        return ValueType::Vec8;
+    return std::nullopt;
+}
+
+/// typeannotation ::= (':' (typename | identifier '[' ']'))?
+/// Returns false after reporting an error; Ty is left unset if there was no
+/// annotation.
+static bool ParseOptionalType(std::optional<ValueType> &Ty)
+{
+    if (CurTok != ':')
+        return true;
+    getNextToken(); // eat ':'.
+
+    if (CurTok == tok_identifier && (Ty = findRecordCollection(IdentifierStr)))
+    {
+        getNextToken(); // eat the record name.
+        if (CurTok != '[' || getNextToken() != ']')
+        {
+            LogError("expected '[]' after record name");
+            return false;
+        }
+        getNextToken(); // eat ].
+        return true;
+    }
+
+    if (CurTok != tok_identifier || !(Ty = getTypeFromName(IdentifierStr)))
+    {
+        LogError("expected a type name after ':'");
+        return false;
+    }
+    getNextToken(); // eat the type name.
+    return true;
+}
+
+/// numberexpr ::= number
+static std::unique_ptr<ExprAST> ParseNumberExpr()
+{
+    auto Result = std::make_unique<NumberExprAST>(NumVal, NumIsInt ? ValueType::Int : ValueType::Double);
+    getNextToken(); // consume the number
+    return std::move(Result);
+}
+
+/// parenexpr ::= '(' expression ')'
+static std::unique_ptr<ExprAST> ParseParenExpr()
+{
+    getNextToken(); // eat (.
+    auto V = ParseExpression();
+    if (!V)
+        return nullptr;
+
+    if (CurTok != ')')
+        return LogError("expected ')'");
+    getNextToken(); // eat ).
+    return V;
+}
+
+/// arglist ::= '(' (expression (',' expression)*)? ')'
+static bool ParseArgList(std::vector<std::unique_ptr<ExprAST>> &Args)
+{
+    getNextToken(); // eat (
+    if (CurTok != ')')
+    {
+        while (true)
+        {
+            if (auto Arg = ParseExpression())
+                Args.push_back(std::move(Arg));
+            else
+                return false;
+
+            if (CurTok == ')')
+                break;
+
+            if (CurTok != ',')
+            {
+                LogError("Expected ')' or ',' in argument list");
+                return false;
+            }
+            getNextToken();
+        }
+    }
+
+    // Eat the ')'.
+    getNextToken();
+    return true;
+}
+
+/// ParseShuffle - Build "shuffle(v, index...)" from its arguments, which after
+/// the vector must be int literals.
+static std::unique_ptr<ExprAST> ParseShuffle(std::vector<std::unique_ptr<ExprAST>> Args)
+{
+    if (Args.size() < 2 || !getVecType(Args.size() - 1))
+        return LogError("shuffle expects a vector and 2, 4 or 8 lane indexes");
+
+    std::vector<int> Mask;
+    for (unsigned i = 1, e = Args.size(); i != e; ++i)
+    {
+        auto *Lane = dyn_cast<NumberExprAST>(Args[i].get());
+        if (!Lane || Lane->getType() != ValueType::Int)
+            return LogError("shuffle lane indexes must be int literals");
+        Mask.push_back((int)Lane->getValue());
+    }
+    return std::make_unique<ShuffleExprAST>(std::move(Args[0]), std::move(Mask));
+}
+
+/// rangereduceexpr
+///   ::= ('sum' | 'prod' | 'min' | 'max') identifier typeannotation '=' expr ',' expr 'in' expression
+/// The reduction's name has already been eaten.
+static std::unique_ptr<ExprAST> ParseRangeReduceExpr(RangeReduceExprAST::ReduceKind Reduction)
+{
+    std::string IdName = IdentifierStr;
+    getNextToken(); // eat identifier.
+
+    std::optional<ValueType> IdType;
+    if (!ParseOptionalType(IdType))
+        return nullptr;
+
+    if (CurTok != '=')
+        return LogError("expected '=' after reduction variable");
+    getNextToken(); // eat '='.
+
+    auto Start = ParseExpression();
+    if (!Start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("expected ',' after reduction start value");
+    getNextToken();
+
+    auto End = ParseExpression();
+    if (!End)
+        return nullptr;
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after reduction range");
+    getNextToken(); // eat 'in'.
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return std::make_unique<RangeReduceExprAST>(Reduction, IdName, IdType, std::move(Start), std::move(End),
+                                                std::move(Body));
+}
+
+/// parallelforexpr ::= 'parallel' 'for' identifier '=' expr ',' expr 'in' expression
+/// The "parallel" has already been eaten.
+static std::unique_ptr<ExprAST> ParseParallelForExpr()
+{
+    getNextToken(); // eat the for.
+
+    if (CurTok != tok_identifier)
+        return LogError("expected identifier after parallel for");
+
+    std::string IdName = IdentifierStr;
+    getNextToken(); // eat identifier.
+
+    if (CurTok != '=')
+        return LogError("expected '=' after parallel for");
+    getNextToken(); // eat '='.
+
+    auto Start = ParseExpression();
+    if (!Start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("expected ',' after parallel for start value");
+    getNextToken();
+
+    auto End = ParseExpression();
+    if (!End)
+        return nullptr;
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after parallel for");
+    getNextToken(); // eat 'in'.
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return std::make_unique<ParallelForExprAST>(IdName, std::move(Start), std::move(End), std::move(Body));
+}
+
+/// identifierexpr
+///   ::= identifier
+///   ::= identifier '[' expression ']' ('.' identifier)?
+///   ::= recordname '[' expression ']'
+///   ::= 'true' | 'false'
+///   ::= identifier arglist
+///   ::= 'array' '(' expression ')'
+///   ::= 'len' '(' expression ')'
+///   ::= vectypename arglist
+///   ::= 'shuffle' arglist
+///   ::= ('hsum' | 'hmin' | 'hmax') '(' expression ')'
+///   ::= typename '(' expression ')'
+///   ::= rangereduceexpr
+///   ::= parallelforexpr
+static std::unique_ptr<ExprAST> ParseIdentifierExpr()
+{
+    std::string IdName = IdentifierStr;
+
+    getNextToken(); // eat identifier.
+
+    if (IdName == "true" || IdName == "false")
+        return std::make_unique<NumberExprAST>(IdName == "true", ValueType::Bool);
+
+    // Reductions.  Their names only act as keywords when a variable follows,
+    // so functions and variables called "sum" or "max" keep working.
+    if (CurTok == tok_identifier)
+    {
+        if (IdName == "sum")
+            return ParseRangeReduceExpr(RangeReduceExprAST::RK_Sum);
+        if (IdName == "prod")
+            return ParseRangeReduceExpr(RangeReduceExprAST::RK_Prod);
+        if (IdName == "min")
+            return ParseRangeReduceExpr(RangeReduceExprAST::RK_Min);
+        if (IdName == "max")
+            return ParseRangeReduceExpr(RangeReduceExprAST::RK_Max);
+    }
+    if (IdName == "parallel" && CurTok == tok_for)
+        return ParseParallelForExpr();
+
+    // Array element, or a new collection of records.
+    if (CurTok == '[')
+    {
+        getNextToken(); // eat [.
+        auto Index = ParseExpression();
+        if (!Index)
+            return nullptr;
+        if (CurTok != ']')
+            return LogError("expected ']'");
+        getNextToken(); // eat ].
+
+        if (auto Ty = findRecordCollection(IdName))
+            return std::make_unique<NewArrayExprAST>(*Ty, std::move(Index));
+
+        std::string Field;
+        if (CurTok == '.')
+        {
+            if (getNextToken() != tok_identifier)
+                return LogError("expected field name after '.'");
+            Field = IdentifierStr;
+            getNextToken(); // eat the field name.
+        }
+        return std::make_unique<IndexExprAST>(std::make_unique<VariableExprAST>(IdName), std::move(Index),
+                                              std::move(Field));
+    }
+
+    if (CurTok != '(') // Simple variable ref.
+        return std::make_unique<VariableExprAST>(IdName);
+
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    if (!ParseArgList(Args))
+        return nullptr;
+
+    // Builtins.  These come before conversions, as "array" and the vector
+    // types are also type names.
+    std::optional<ValueType> Ty = getTypeFromName(IdName);
+    if (Ty && isVector(*Ty))
+    {
+        if (Args.size() != 1 && Args.size() != getVecWidth(*Ty))
+            return LogError("vector literals take one value per lane, or a single value for all of them");
+        return std::make_unique<VecExprAST>(*Ty, std::move(Args));
+    }
+    if (IdName == "shuffle")
+        return ParseShuffle(std::move(Args));
+
+    bool IsUnaryBuiltin =
+        IdName == "array" || IdName == "len" || IdName == "hsum" || IdName == "hmin" || IdName == "hmax";
+    if (!IsUnaryBuiltin && !Ty)
+        return std::make_unique<CallExprAST>(IdName, std::move(Args));
+
+    if (Args.size() != 1)
+        return LogError("expected a single operand");
+    if (IdName == "array")
+        return std::make_unique<NewArrayExprAST>(ValueType::Array, std::move(Args[0]));
+    if (IdName == "len")
+        return std::make_unique<LenExprAST>(std::move(Args[0]));
+    if (IdName == "hsum")
+        return std::make_unique<ReduceExprAST>(ReduceExprAST::RK_Sum, std::move(Args[0]));
+    if (IdName == "hmin")
+        return std::make_unique<ReduceExprAST>(ReduceExprAST::RK_Min, std::move(Args[0]));
+    if (IdName == "hmax")
+        return std::make_unique<ReduceExprAST>(ReduceExprAST::RK_Max, std::move(Args[0]));
+
+    // Explicit conversion.
+    return std::make_unique<CastExprAST>(*Ty, std::move(Args[0]));
+}
+
+/// ifexpr ::= 'if' expression 'then' expression 'else' expression
+static std::unique_ptr<ExprAST> ParseIfExpr()
+{
+    getNextToken(); // eat the if.
+
+    // condition.
+    auto Cond = ParseExpression();
+    if (!Cond)
+        return nullptr;
+
+    if (CurTok != tok_then)
+        return LogError("expected then");
+    getNextToken(); // eat the then
+
+    auto Then = ParseExpression();
+    if (!Then)
+        return nullptr;
+
+    if (CurTok != tok_else)
+        return LogError("expected else");
+
+    getNextToken();
+
+    auto Else = ParseExpression();
+    if (!Else)
+        return nullptr;
+
+    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+}
+
+/// forexpr
+///   ::= 'for' identifier typeannotation '=' expr ',' expr (',' expr)? 'in' expression
+static std::unique_ptr<ExprAST> ParseForExpr()
+{
+    getNextToken(); // eat the for.
+
+    if (CurTok != tok_identifier)
+        return LogError("expected identifier after for");
+
+    std::string IdName = IdentifierStr;
+    getNextToken(); // eat identifier.
+
+    std::optional<ValueType> IdType;
+    if (!ParseOptionalType(IdType))
+        return nullptr;
+
+    if (CurTok != '=')
+        return LogError("expected '=' after for");
+    getNextToken(); // eat '='.
+
+    auto Start = ParseExpression();
+    if (!Start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("expected ',' after for start value");
+    getNextToken();
+
+    auto End = ParseExpression();
+    if (!End)
+        return nullptr;
+
+    // The step value is optional.
+    std::unique_ptr<ExprAST> Step;
+    if (CurTok == ',')
+    {
+        getNextToken();
+        Step = ParseExpression();
+        if (!Step)
+            return nullptr;
+    }
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after for");
+    getNextToken(); // eat 'in'.
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return std::make_unique<ForExprAST>(IdName, IdType, std::move(Start), std::move(End), std::move(Step),
+                                        std::move(Body));
+}
+
+/// whileexpr ::= 'while' expression 'in' expression
+static std::unique_ptr<ExprAST> ParseWhileExpr()
+{
+    getNextToken(); // eat the while.
+
+    auto Cond = ParseExpression();
+    if (!Cond)
+        return nullptr;
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after while");
+    getNextToken(); // eat 'in'.
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return std::make_unique<WhileExprAST>(std::move(Cond), std::move(Body));
+}
+
+/// breakexpr ::= 'break'
+static std::unique_ptr<ExprAST> ParseBreakExpr()
+{
+    getNextToken(); // eat the break.
+    return std::make_unique<BreakExprAST>();
+}
+
+/// returnexpr ::= 'return' expression
+static std::unique_ptr<ExprAST> ParseReturnExpr()
+{
+    getNextToken(); // eat the return.
+
+    auto Val = ParseExpression();
+    if (!Val)
+        return nullptr;
+
+    return std::make_unique<ReturnExprAST>(std::move(Val));
+}
+
+/// varexpr ::= 'var' identifier typeannotation ('=' expression)?
+//                    (',' identifier typeannotation ('=' expression)?)* 'in' expression
+static std::unique_ptr<ExprAST> ParseVarExpr()
+{
+    getNextToken(); // eat the var.
+
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    std::vector<std::optional<ValueType>> VarTypes;
+
+    // At least one variable name is required.
+    if (CurTok != tok_identifier)
+        return LogError("expected identifier after var");
+
+    while (true)
+    {
+        std::string Name = IdentifierStr;
+        getNextToken(); // eat identifier.
+
+        std::optional<ValueType> Ty;
+        if (!ParseOptionalType(Ty))
+            return nullptr;
+        VarTypes.push_back(Ty);
+
+        // Read the optional initializer.
+        std::unique_ptr<ExprAST> Init = nullptr;
+        if (CurTok == '=')
+        {
+            getNextToken(); // eat the '='.
+
+            Init = ParseExpression();
+            if (!Init)
+                return nullptr;
+        }
+
+        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+
+        // End of var list, exit loop.
+        if (CurTok != ',')
+            break;
+        getNextToken(); // eat the ','.
+
+        if (CurTok != tok_identifier)
+            return LogError("expected identifier list after var");
+    }
+
+    // At this point, we have to have 'in'.
+    if (CurTok != tok_in)
+        return LogError("expected 'in' keyword after 'var'");
+    getNextToken(); // eat 'in'.
+
+    auto Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(VarTypes), std::move(Body));
+}
+
+/// primary
+///   ::= identifierexpr
+///   ::= numberexpr
+///   ::= parenexpr
+///   ::= ifexpr
+///   ::= forexpr
+///   ::= whileexpr
+///   ::= breakexpr
+///   ::= returnexpr
+///   ::= varexpr
+static std::unique_ptr<ExprAST> ParsePrimary()
+{
+    switch (CurTok)
+    {
+    default:
+        return LogError("unknown token when expecting an expression");
+    case tok_identifier:
+        return ParseIdentifierExpr();
+    case tok_number:
+        return ParseNumberExpr();
+    case '(':
+        return ParseParenExpr();
+    case tok_if:
+        return ParseIfExpr();
+    case tok_for:
+        return ParseForExpr();
+    case tok_while:
+        return ParseWhileExpr();
+    case tok_break:
+        return ParseBreakExpr();
+    case tok_return:
+        return ParseReturnExpr();
+    case tok_var:
+        return ParseVarExpr();
+    }
+}
+
+/// unary
+///   ::= primary
+///   ::= '!' unary
+static std::unique_ptr<ExprAST> ParseUnary()
+{
+    // If the current token is not an operator, it must be a primary expr.
+    if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
+        return ParsePrimary();
+
+    // If this is a unary operator, read it.
+    int Opc = CurTok;
+    getNextToken();
+    if (auto Operand = ParseUnary())
+        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    return nullptr;
+}
+
+/// binoprhs
+///   ::= ('+' unary)*
+static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS)
+{
+    // If this is a binop, find its precedence.
+    while (true)
+    {
+        int TokPrec = GetTokPrecedence();
+
+        // If this is a binop that binds at least as tightly as the current binop,
+        // consume it, otherwise we are done.
+        if (TokPrec < ExprPrec)
+            return LHS;
+
+        // Okay, we know this is a binop.
+        int BinOp = CurTok;
+        getNextToken(); // eat binop
+
+        // Parse the unary expression after the binary operator.
+        auto RHS = ParseUnary();
+        if (!RHS)
+            return nullptr;
+
+        // If BinOp binds less tightly with RHS than the operator after RHS, let
+        // the pending operator take RHS as its LHS.
+        int NextPrec = GetTokPrecedence();
+        if (TokPrec < NextPrec)
+        {
+            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+            if (!RHS)
+                return nullptr;
+        }
+
+        // Merge LHS/RHS.
+        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+    }
+}
+
+/// expression
+///   ::= unary binoprhs
+///
+static std::unique_ptr<ExprAST> ParseExpression()
+{
+    auto LHS = ParseUnary();
+    if (!LHS)
+        return nullptr;
+
+    return ParseBinOpRHS(0, std::move(LHS));
+}
+
+/// prototype
+///   ::= attribute* id '(' (id typeannotation)* ')' typeannotation
+///   ::= attribute* binary LETTER number? (id, id) typeannotation
+///   ::= attribute* unary LETTER (id) typeannotation
+/// attribute
+///   ::= 'tailrec'
+///   ::= 'memo'
+///   ::= 'multiversion'
+static std::unique_ptr<PrototypeAST> ParsePrototype()
+{
+    std::string FnName;
+
+    unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
+    unsigned BinaryPrecedence = 30;
+
+    bool TailRec = false, Memo = false, MultiVersion = false;
+    while (CurTok == tok_tailrec || CurTok == tok_memo || CurTok == tok_multiversion)
+    {
+        (CurTok == tok_tailrec ? TailRec : CurTok == tok_memo ? Memo : MultiVersion) = true;
+        getNextToken(); // eat the attribute.
+    }
+
+    switch (CurTok)
+    {
+    default:
+        return LogErrorP("Expected function name in prototype");
+    case tok_identifier:
+        FnName = IdentifierStr;
+        Kind = 0;
+        getNextToken();
+        break;
+    case tok_unary:
+        getNextToken();
+        if (!isascii(CurTok))
+            return LogErrorP("Expected unary operator");
+        FnName = "unary";
+        FnName += (char)CurTok;
+        Kind = 1;
+        getNextToken();
+        break;
+    case tok_binary:
+        getNextToken();
+        if (!isascii(CurTok))
+            return LogErrorP("Expected binary operator");
+        FnName = "binary";
+        FnName += (char)CurTok;
+        Kind = 2;
+        getNextToken();
+
+        // Read the precedence if present.
+        if (CurTok == tok_number)
+        {
+            if (NumVal < 1 || NumVal > 100)
+                return LogErrorP("Invalid precedence: must be 1..100");
+            BinaryPrecedence = (unsigned)NumVal;
+            getNextToken();
+        }
+        break;
+    }
+
+    if (CurTok != '(')
+        return LogErrorP("Expected '(' in prototype");
+
+    // Arguments and the return type are doubles unless annotated otherwise.
+    std::vector<std::string> ArgNames;
+    std::vector<ValueType> ArgTypes;
+    getNextToken(); // eat '('.
+    while (CurTok == tok_identifier)
+    {
+        ArgNames.push_back(IdentifierStr);
+        getNextToken(); // eat identifier.
+
+        std::optional<ValueType> Ty;
+        if (!ParseOptionalType(Ty))
+            return nullptr;
+        ArgTypes.push_back(Ty.value_or(ValueType::Double));
+    }
+    if (CurTok != ')')
+        return LogErrorP("Expected ')' in prototype");
+
+    // success.
+    getNextToken(); // eat ')'.
+
+    std::optional<ValueType> RetType;
+    if (!ParseOptionalType(RetType))
+        return nullptr;
+
+    // Verify right number of names for operator.
+    if (Kind && ArgNames.size() != Kind)
+        return LogErrorP("Invalid number of operands for operator");
+
+    auto Proto = std::make_unique<PrototypeAST>(FnName, ArgNames, ArgTypes, RetType.value_or(ValueType::Double),
+                                                Kind != 0, BinaryPrecedence);
+    if (TailRec)
+        Proto->setTailRec();
+    if (Memo)
+        Proto->setMemo();
+    if (MultiVersion)
+        Proto->setMultiVersion();
+    return Proto;
+}
+
+/// definition ::= 'def' prototype expression
+static std::unique_ptr<FunctionAST> ParseDefinition()
+{
+    getNextToken(); // eat def.
+    auto Proto = ParsePrototype();
+    if (!Proto)
+        return nullptr;
+
+    if (auto E = ParseExpression())
+        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return nullptr;
+}
+
+/// toplevelexpr ::= expression
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
+{
+    if (auto E = ParseExpression())
+    {
+        // Make an anonymous proto.
+        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>(),
+                                                    std::vector<ValueType>(), ValueType::Double);
+        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    }
+    return nullptr;
+}
+
+/// external ::= 'extern' prototype
+static std::unique_ptr<PrototypeAST> ParseExtern()
+{
+    getNextToken(); // eat extern.
+    return ParsePrototype();
+}
+
+/// globaldecl ::= ('const' | 'global') identifier typeannotation '=' expression
+static std::unique_ptr<GlobalAST> ParseGlobal()
+{
+    bool IsConst = CurTok == tok_const;
+    getNextToken(); // eat const or global.
+
+    if (CurTok != tok_identifier)
+    {
+        LogError("expected name after const or global");
+        return nullptr;
+    }
+    std::string Name = IdentifierStr;
+    getNextToken(); // eat identifier.
+
+    std::optional<ValueType> Ty;
+    if (!ParseOptionalType(Ty))
+        return nullptr;
+
+    if (CurTok != '=')
+    {
+        LogError("expected '=' after const or global name");
+        return nullptr;
+    }
+    getNextToken(); // eat '='.
+
+    auto Init = ParseExpression();
+    if (!Init)
+        return nullptr;
+    return std::make_unique<GlobalAST>(Name, IsConst, Ty, std::move(Init));
+}
+
+/// record ::= 'record' 'aos'? identifier '(' (identifier typeannotation)* ')'
+static std::optional<RecordDecl> ParseRecord()
+{
+    getNextToken(); // eat record.
+
+    RecordDecl R;
+    if (CurTok == tok_identifier && IdentifierStr == "aos")
+    {
+        // Unless "aos" is the record's own name.
+        getNextToken(); // eat aos.
+        if (CurTok == '(')
+            R.Name = "aos";
+        else
+            R.AoS = true;
+    }
+    if (R.Name.empty())
+    {
+        if (CurTok != tok_identifier)
+        {
+            LogError("expected record name");
+            return std::nullopt;
+        }
+        R.Name = IdentifierStr;
+        getNextToken(); // eat the name.
+    }
+    if (findRecordCollection(R.Name) || getTypeFromName(R.Name))
+    {
+        LogError("a type with this name already exists");
+        return std::nullopt;
+    }
+
+    if (CurTok != '(')
+    {
+        LogError("expected '(' in record");
+        return std::nullopt;
+    }
+    getNextToken(); // eat '('.
+
+    // Fields are doubles unless annotated otherwise.
+    while (CurTok == tok_identifier)
+    {
+        if (R.getFieldIndex(IdentifierStr) >= 0)
+        {
+            LogError("duplicate record field");
+            return std::nullopt;
+        }
+        R.Fields.push_back(IdentifierStr);
+        getNextToken(); // eat identifier.
+
+        std::optional<ValueType> Ty;
+        if (!ParseOptionalType(Ty))
+            return std::nullopt;
+        if (Ty && *Ty != ValueType::Int && *Ty != ValueType::Double)
+        {
+            LogError("record fields must be int or double");
+            return std::nullopt;
+        }
+        R.FieldTypes.push_back(Ty.value_or(ValueType::Double));
+    }
+    if (CurTok != ')')
+    {
+        LogError("expected ')' in record");
+        return std::nullopt;
+    }
+    getNextToken(); // eat ')'.
+
+    if (R.Fields.empty())
+    {
+        LogError("records need at least one field");
+        return std::nullopt;
+    }
+    R.CollectionName = R.Name + "[]";
+    return R;
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+static std::unique_ptr<LLVMContext> TheContext;
+static std::unique_ptr<Module> TheModule;
+static std::unique_ptr<IRBuilder<>> Builder;
+static std::map<std::string, AllocaInst *> NamedValues;
+static std::unique_ptr<KaleidoscopeJIT> TheJIT;
+static std::unique_ptr<FunctionPassManager> TheFPM;
+static std::unique_ptr<LoopAnalysisManager> TheLAM;
+static std::unique_ptr<FunctionAnalysisManager> TheFAM;
+static std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+static std::unique_ptr<ModuleAnalysisManager> TheMAM;
+static std::unique_ptr<LLVMContext> TheSIContext;
+static std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
+static std::unique_ptr<StandardInstrumentations> TheSI;
+static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+static ExitOnError ExitOnErr;
+
+// The function being emitted.  Self calls in tail position store their
+// arguments back into the parameter allocas and branch to TailRecurseBB.
+static const PrototypeAST *CurFnProto;
+static std::vector<AllocaInst *> CurFnArgAllocas;
+static BasicBlock *TailRecurseBB;
+
+/// CountedLoop - A for loop "for i = Start, i < Bound in Body" (or "<=") whose
+/// int variable counts up by one.  The end condition is tested after the body,
+/// so the body runs with i = Start, Start + 1, ..., max(Start, Bound).  As long
+/// as neither i nor the bound changes inside the loop, a[i] is in bounds on
+/// every iteration if Start >= 0 and max(Start, Bound) < len(a).  That fact is
+/// loop-invariant: it is computed once before the loop and or'ed into each
+/// bounds check, and loop unswitching then gives the in-bounds case a copy of
+/// the loop without any checks, which can be vectorized.
+struct CountedLoop
+{
+    AllocaInst *Var;
+    Value *Start;
+    Value *Bound = nullptr; // Null if the loop doesn't have this form.
+    bool Inclusive = false;
+    Instruction *Entry = nullptr; // The branch into the loop.
+
+    std::vector<AllocaInst *> BoundVars;        // Locals the bound reads.
+    std::map<AllocaInst *, Value *> InBounds; // Array local -> precomputed fact.
+
+    CountedLoop(AllocaInst *Var, Value *Start) : Var(Var), Start(Start)
+    {
+    }
+
+    bool emitBound(BinaryExprAST &Cond);
+    Value *getInBounds(AllocaInst *Array);
+    void finish(BasicBlock *LoopBB, Value *StepVal, StoreInst *CounterCopy = nullptr);
+};
+
+/// CountedLoops - The counted loops enclosing the code being emitted.
+static std::vector<CountedLoop *> CountedLoops;
+
+/// LoopExits - The blocks following each loop enclosing the code being
+/// emitted, innermost last.  "break" branches to the last one.  Reductions
+/// and parallel loops can't be left early and push null.
+static std::vector<BasicBlock *> LoopExits;
+
+/// ParallelChunks - The functions outlined from the parallel for loops of the
+/// function being emitted, outermost first.  They are optimized with it.
+static std::vector<Function *> ParallelChunks;
+
+// Optimization statistics, printed on exit with -print-stats.
+static unsigned NumFunctionsDefined;
+static unsigned NumFunctionsInferredPure;
+static unsigned NumCallsBeforeOpt;
+static unsigned NumCallsAfterOpt;
+static unsigned NumCallsInlined;
+static unsigned NumTailCallsToLoops;
+static unsigned NumMustTailCalls;
+static unsigned NumBoundsChecks;
+static unsigned NumBoundsChecksHoisted;
+static unsigned NumLoopsVectorized;
+static unsigned NumSpecializations;
+static unsigned NumCallsSpecialized;
+static unsigned NumParallelLoops;
+static unsigned NumMultiVersioned;
+
+static cl::opt<unsigned> MemoCacheSize("memo-cache-size", cl::desc("Number of entries in each memo function's cache"),
+                                       cl::init(4096));
+
+/// MemoCache - The cache of a memo function: a direct-mapped hash table from
+/// the bit patterns of the arguments to those of the result.  The compiler
+/// owns it and JIT'd code only reaches it through kal_memo_lookup and
+/// kal_memo_store, so to the optimizer it is memory the module can't access.
+struct MemoCache
+{
+    std::string Name;
+    unsigned NumArgs;
+    uint64_t Mask;
+    std::vector<uint64_t> Entries; // Each is a valid flag, the key, the result.
+    uint64_t Hits = 0, Misses = 0;
+    std::mutex Lock; // Memo functions may be called from parallel loops.
+
+    MemoCache(const std::string &Name, unsigned NumArgs, unsigned Capacity)
+        : Name(Name), NumArgs(NumArgs), Mask(PowerOf2Ceil(std::max(Capacity, 1u)) - 1),
+          Entries((Mask + 1) * (NumArgs + 2))
+    {
+    }
+
+    /// getEntry - The one entry that Key can be cached in.
+    uint64_t *getEntry(const uint64_t *Key)
+    {
+        uint64_t Hash = 0;
+        for (unsigned i = 0; i != NumArgs; ++i)
+        {
+            Hash = (Hash ^ Key[i]) * 0x9e3779b97f4a7c15ULL;
+            Hash ^= Hash >> 29;
+        }
+        return &Entries[(Hash & Mask) * (NumArgs + 2)];
+    }
+};
+
+/// MemoCaches - The caches of every memo function defined so far.
+static std::vector<std::unique_ptr<MemoCache>> MemoCaches;
+
+Value *LogErrorV(const char *Str)
+{
+    LogError(Str);
+    return nullptr;
+}
+
+Function *getFunction(std::string Name)
+{
+    // First, see if the function has already been added to the current module.
+    if (auto *F = TheModule->getFunction(Name))
+        return F;
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen();
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+/// the function.  This is used for mutable variables etc.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName, Type *Ty)
+{
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+/// countCalls - Count the calls to real (non-intrinsic) functions in F.
+static unsigned countCalls(Function &F)
+{
+    unsigned N = 0;
+    for (auto &BB : F)
+        for (auto &I : BB)
+            if (auto *CI = dyn_cast<CallInst>(&I))
+                if (!isa<IntrinsicInst>(CI))
+                    ++N;
+    return N;
+}
+
+/// countVectorizedLoops - Count the loops in F the loop vectorizer has turned
+/// into vector loops.  It marks the scalar remainder loops it leaves behind as
+/// vectorized too, so only count loops whose latch does vector work.
+static unsigned countVectorizedLoops(Function &F)
+{
+    unsigned N = 0;
+    for (auto &BB : F)
+    {
+        MDNode *LoopID = BB.getTerminator()->getMetadata(LLVMContext::MD_loop);
+        if (!LoopID || !findOptionMDForLoopID(LoopID, "llvm.loop.isvectorized"))
+            continue;
+        if (any_of(BB, [](Instruction &I) {
+                return I.getType()->isVectorTy() ||
+                       (isa<StoreInst>(I) && cast<StoreInst>(I).getValueOperand()->getType()->isVectorTy());
+            }))
+            ++N;
+    }
+    return N;
+}
+
+/// RetainedFunction - The optimized bitcode of an earlier definition.  Each
+/// definition lives in its own module, so later modules can only inline or
+/// specialize it by importing this.
+struct RetainedFunction
+{
+    std::string Bitcode;
+    unsigned Size;     // Instructions in the optimized body.
+    bool AlwaysInline; // User operators are inlined into every use.
+    std::vector<std::string> Importers; // Functions that may have inlined or specialized it.
+};
+
+/// RetainedIR - Every retained definition, keyed by function name.  A
+/// function is dropped from here when it is redefined, and never retained
+/// again, so that later callers keep calling it through its stub.
+static std::map<std::string, RetainedFunction> RetainedIR;
+
+/// DefinedFunctions - The names of the functions defined so far, other than
+/// top-level expressions and global initializers.  Defining one again
+/// replaces it.
+static std::set<std::string> DefinedFunctions;
+
+/// noteImporter - Record that the function being defined copies in R's body.
+static void noteImporter(RetainedFunction &R)
+{
+    const std::string &Caller = CurFnProto->getName();
+    if (!StringRef(Caller).starts_with("__") && !is_contained(R.Importers, Caller))
+        R.Importers.push_back(Caller);
+}
+
+/// retainIR - Remember the optimized body of F for later imports.
+static void retainIR(Function &F, bool AlwaysInline)
+{
+    std::string Bitcode;
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(*F.getParent(), OS);
+    OS.flush();
+    RetainedIR[std::string(F.getName())] = {std::move(Bitcode), F.getInstructionCount(), AlwaysInline};
+}
+
+static cl::opt<int> ImportInlineThreshold("import-inline-threshold",
+                                          cl::desc("Inline cost budget for calls to functions defined in "
+                                                   "earlier modules"),
+                                          cl::init(225));
+
+/// inlineImportedCallees - Link the retained bodies of F's callees into the
+/// current module as available_externally definitions, inline them (operators
+/// always, other functions within ImportInlineThreshold) and turn whatever is
+/// left of them back into declarations.  Returns the number of calls that were
+/// inlined.
+static unsigned inlineImportedCallees(Function &F)
+{
+    // Inlining a call erases it, so the calls to imports that are gone
+    // afterwards are the ones inlined.
+    std::vector<std::string> Imported;
+    std::vector<WeakVH> Sites;
+    for (auto &BB : F)
+        for (auto &I : BB)
+            if (auto *CI = dyn_cast<CallInst>(&I))
+                if (Function *Callee = CI->getCalledFunction())
+                {
+                    std::string Name(Callee->getName());
+                    auto It = RetainedIR.find(Name);
+                    if (!Callee->isDeclaration() || It == RetainedIR.end())
+                        continue;
+                    Sites.push_back(CI);
+                    if (!is_contained(Imported, Name))
+                        Imported.push_back(Name);
+                }
+    if (Imported.empty())
+        return 0;
+
+    for (auto &Name : Imported)
+    {
+        noteImporter(RetainedIR[Name]);
+        auto Src = ExitOnErr(parseBitcodeFile(MemoryBufferRef(RetainedIR[Name].Bitcode, Name), *TheContext));
+        Function *Def = Src->getFunction(Name);
+        Def->setLinkage(GlobalValue::AvailableExternallyLinkage);
+        if (RetainedIR[Name].AlwaysInline)
+            Def->addFnAttr(Attribute::AlwaysInline);
+        if (Linker::linkModules(*TheModule, std::move(Src), Linker::Flags::LinkOnlyNeeded))
+            fprintf(stderr, "Error: could not import %s for inlining\n", Name.c_str());
+    }
+
+    ModulePassManager MPM;
+    MPM.addPass(ModuleInlinerWrapperPass(getInlineParams(ImportInlineThreshold)));
+    MPM.run(*TheModule, *TheMAM);
+
+    // Drop the call graph the inliner cached before changing it underneath.
+    TheMAM->invalidate(*TheModule, PreservedAnalyses::none());
+
+    // The inliner deletes imports it no longer needs; anything left (e.g. a
+    // recursive or oversized callee) must not be redefined by this module.
+    for (auto &Name : Imported)
+        if (Function *G = TheModule->getFunction(Name); G && !G->isDeclaration())
+        {
+            TheFAM->clear(*G, Name);
+            G->deleteBody();
+            G->removeFnAttr(Attribute::AlwaysInline);
+        }
+
+    return count_if(Sites, [](const WeakVH &Site) { return !Site; });
+}
+
+static cl::opt<unsigned> SpecializeMaxSize("specialize-max-size",
+                                           cl::desc("Largest function, in instructions, to specialize on "
+                                                    "constant arguments at any call"),
+                                           cl::init(40));
+static cl::opt<unsigned> SpecializeHotMaxSize("specialize-hot-max-size",
+                                              cl::desc("Largest function, in instructions, to specialize on "
+                                                       "constant arguments at calls inside loops"),
+                                              cl::init(400));
+
+/// Specializations - The symbols of specialized copies of earlier functions,
+/// keyed by the function and the bits of each argument fixed to a constant
+/// (unset for the ones that stay parameters).  Each copy is built once, in a
+/// module of its own, and shared by every later call with the same constants.
+static std::map<std::pair<std::string, std::vector<std::optional<uint64_t>>>, std::string> Specializations;
+
+/// getConstantBits - The 64-bit pattern of V, if it is a scalar constant.
+static std::optional<uint64_t> getConstantBits(Value *V)
+{
+    if (auto *CI = dyn_cast<ConstantInt>(V))
+        return CI->getZExtValue();
+    if (auto *CFP = dyn_cast<ConstantFP>(V))
+        return CFP->getValueAPF().bitcastToAPInt().getZExtValue();
+    return std::nullopt;
+}
+
+/// buildSpecialization - Compile a copy of retained function Name, with the
+/// arguments Consts gives bits for replaced by those constants, and add it to
+/// the JIT as SpecName.
+static void buildSpecialization(const std::string &Name, const std::vector<std::optional<uint64_t>> &Consts,
+                                const std::string &SpecName)
+{
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = ExitOnErr(parseBitcodeFile(MemoryBufferRef(RetainedIR[Name].Bitcode, Name), *Ctx));
+    Function *G = M->getFunction(Name);
+
+    // Cloning drops the parameters that VMap maps to constants.
+    ValueToValueMapTy VMap;
+    for (auto &Arg : G->args())
+        if (auto Bits = Consts[Arg.getArgNo()])
+            VMap[&Arg] = Arg.getType()->isDoubleTy() ? ConstantFP::get(*Ctx, APFloat(llvm::bit_cast<double>(*Bits)))
+                                                     : ConstantInt::get(Arg.getType(), *Bits);
+    Function *Spec = CloneFunction(G, VMap);
+    Spec->setName(SpecName);
+
+    // Calls back to the original reach the definition already in the JIT.
+    // A musttail call can't stay one in a function of a different type.
+    G->deleteBody();
+    for (auto &BB : *Spec)
+        for (auto &I : BB)
+            if (auto *CI = dyn_cast<CallInst>(&I); CI && CI->isMustTailCall())
+                CI->setTailCallKind(CallInst::TCK_Tail);
+
+    // Fold the constants through the body.  The copy lives in a context of
+    // its own, so it gets pass and analysis managers of its own too.
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(&TheJIT->getTargetMachine());
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    FunctionPassManager FPM;
+    FPM.addPass(InstCombinePass());
+    FPM.addPass(GVNPass());
+    FPM.addPass(SimplifyCFGPass());
+    FPM.run(*Spec, FAM);
+    ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(M), std::move(Ctx))));
+}
+
+/// specializeCalls - Redirect calls in F that pass constants to a function
+/// from an earlier module to a copy specialized on those constants, if the
+/// function is small enough for how hot the call is: calls inside loops may
+/// specialize bigger functions, and a top-level expression, which runs once,
+/// only specializes those.  Returns the number of calls redirected.
+static unsigned specializeCalls(Function &F, bool RunsOnce)
+{
+    LoopInfo &LI = TheFAM->getResult<LoopAnalysis>(F);
+    std::vector<CallInst *> Calls;
+    for (auto &BB : F)
+        for (auto &I : BB)
+            if (auto *CI = dyn_cast<CallInst>(&I))
+                Calls.push_back(CI);
+
+    unsigned N = 0;
+    for (CallInst *CI : Calls)
+    {
+        Function *Callee = CI->getCalledFunction();
+        if (!Callee || !Callee->isDeclaration())
+            continue;
+        auto It = RetainedIR.find(std::string(Callee->getName()));
+        if (It == RetainedIR.end() || It->second.AlwaysInline)
+            continue;
+        bool Hot = LI.getLoopFor(CI->getParent());
+        if ((RunsOnce && !Hot) || It->second.Size > (Hot ? SpecializeHotMaxSize : SpecializeMaxSize))
+            continue;
+
+        std::vector<std::optional<uint64_t>> Consts;
+        std::vector<Value *> Args;
+        for (Value *Arg : CI->args())
+        {
+            Consts.push_back(getConstantBits(Arg));
+            if (!Consts.back())
+                Args.push_back(Arg);
+        }
+        if (Args.size() == CI->arg_size())
+            continue;
+
+        noteImporter(It->second);
+        auto [SpecIt, Inserted] = Specializations.try_emplace({It->first, Consts});
+        if (Inserted)
+        {
+            SpecIt->second = It->first + ".spec" + std::to_string(Specializations.size());
+            buildSpecialization(It->first, Consts, SpecIt->second);
+            ++NumSpecializations;
+        }
+
+        Function *Spec = TheModule->getFunction(SpecIt->second);
+        if (!Spec)
+        {
+            std::vector<Type *> ParamTypes;
+            for (Value *Arg : Args)
+                ParamTypes.push_back(Arg->getType());
+            Spec = Function::Create(FunctionType::get(CI->getType(), ParamTypes, false), Function::ExternalLinkage,
+                                    SpecIt->second, TheModule.get());
+            Spec->copyAttributesFrom(Callee);
+        }
+        CallInst *NewCI = CallInst::Create(Spec, Args, "", CI);
+        NewCI->takeName(CI);
+        NewCI->setTailCallKind(CI->isMustTailCall() ? CallInst::TCK_Tail : CI->getTailCallKind());
+        CI->replaceAllUsesWith(NewCI);
+        CI->eraseFromParent();
+        ++N;
+    }
+    return N;
+}
+
+/// getLLVMType - The LLVM type used to represent values of type T.
+static Type *getLLVMType(ValueType T)
+{
+    // Collections are a pointer to their storage, wrapped in a struct named
+    // after the record so that LLVM values still say which record they hold.
+    if (isRecordCollection(T))
+    {
+        std::string Name = "record." + getRecord(T).Name;
+        if (StructType *ST = StructType::getTypeByName(*TheContext, Name))
+            return ST;
+        return StructType::create(*TheContext, {PointerType::getUnqual(*TheContext)}, Name);
+    }
+
+    switch (T)
+    {
+    case ValueType::Bool:
+        return Type::getInt1Ty(*TheContext);
+    case ValueType::Int:
+        return Type::getInt64Ty(*TheContext);
+    case ValueType::Double:
+        return Type::getDoubleTy(*TheContext);
+    case ValueType::Array:
+        return PointerType::getUnqual(*TheContext);
+    case ValueType::Vec2:
+    case ValueType::Vec4:
+    case ValueType::Vec8:
+        return FixedVectorType::get(Type::getDoubleTy(*TheContext), getVecWidth(T));
+    }
+    llvm_unreachable("unknown value type");
+}
+
+/// getValueType - The Kaleidoscope type of values of LLVM type Ty.
+static ValueType getValueType(Type *Ty)
+{
+    if (Ty->isIntegerTy(1))
+        return ValueType::Bool;
+    if (Ty->isIntegerTy())
+        return ValueType::Int;
+    if (Ty->isPointerTy())
+        return ValueType::Array;
+    if (auto *VecTy = dyn_cast<FixedVectorType>(Ty))
+        return *getVecType(VecTy->getNumElements());
+    if (auto *ST = dyn_cast<StructType>(Ty); ST && ST->hasName())
+    {
+        // Strip "record." and any ".N" suffix the context added to keep the
+        // name unique.
+        StringRef Name = ST->getName().drop_front(strlen("record."));
+        return *findRecordCollection(Name.split('.').first);
+    }
+    return ValueType::Double;
+}
+
+static const char *getTypeName(ValueType T)
+{
+    if (isRecordCollection(T))
+        return getRecord(T).CollectionName.c_str();
+
+    switch (T)
+    {
+    case ValueType::Bool:
+        return "bool";
+    case ValueType::Int:
+        return "int";
+    case ValueType::Double:
+        return "double";
+    case ValueType::Array:
+        return "array";
+    case ValueType::Vec2:
+        return "vec2";
+    case ValueType::Vec4:
+        return "vec4";
+    case ValueType::Vec8:
+        return "vec8";
+    }
+    llvm_unreachable("unknown value type");
+}
+
+/// convertTo - Convert V to type T.  Implicit conversions may only widen, from
+/// bool to int to double; anything else needs an explicit one like "int(x)".
+static Value *convertTo(Value *V, ValueType T, bool Explicit = false)
+{
+    ValueType From = getValueType(V->getType());
+    if (From == T)
+        return V;
+    if (!isScalar(From) || !isScalar(T))
+    {
+        std::string Msg = std::string("cannot convert ") + getTypeName(From) + " to " + getTypeName(T);
+        return LogErrorV(Msg.c_str());
+    }
+    if (From > T && !Explicit)
+    {
+        std::string Msg = std::string("cannot implicitly convert ") + getTypeName(From) + " to " + getTypeName(T);
+        return LogErrorV(Msg.c_str());
+    }
+
+    switch (T)
+    {
+    case ValueType::Bool:
+        if (From == ValueType::Int)
+            return Builder->CreateICmpNE(V, ConstantInt::get(V->getType(), 0), "tobool");
+        return Builder->CreateFCmpONE(V, ConstantFP::get(*TheContext, APFloat(0.0)), "tobool");
+    case ValueType::Int:
+        if (From == ValueType::Bool)
+            return Builder->CreateZExt(V, getLLVMType(T), "toint");
+        return Builder->CreateFPToSI(V, getLLVMType(T), "toint");
+    case ValueType::Double:
+        // Convert bool 0/1 to double 0.0 or 1.0
+        if (From == ValueType::Bool)
+            return Builder->CreateUIToFP(V, getLLVMType(T), "booltmp");
+        return Builder->CreateSIToFP(V, getLLVMType(T), "todouble");
+    default:
+        break;
+    }
+    llvm_unreachable("unknown value type");
+}
+
+/// splatTo - Convert V to vector type T, repeating a scalar in every lane.
+static Value *splatTo(Value *V, ValueType T)
+{
+    if (!isScalar(getValueType(V->getType())))
+        return convertTo(V, T);
+    V = convertTo(V, ValueType::Double);
+    return V ? Builder->CreateVectorSplat(getVecWidth(T), V, "splat") : nullptr;
+}
+
+/// getArrayStorageType - The layout of the memory an array points to, as set
+/// up by kal_array_new: the length followed by the elements.
+static StructType *getArrayStorageType()
+{
+    return StructType::get(Type::getInt64Ty(*TheContext), ArrayType::get(Type::getDoubleTy(*TheContext), 0));
+}
+
+/// getStoragePtr - The pointer to the storage of Agg, an array or a collection
+/// of records.  Collections share the array layout, with a slot per field of
+/// each element.
+static Value *getStoragePtr(IRBuilderBase &B, Value *Agg)
+{
+    if (isRecordCollection(getValueType(Agg->getType())))
+        return B.CreateExtractValue(Agg, 0, "storage");
+    return Agg;
+}
+
+/// emitArrayLength - Load the length of array Arr.  Arrays never change length,
+/// so the load is marked invariant and can be hoisted out of loops freely.
+static Value *emitArrayLength(IRBuilderBase &B, Value *Arr)
+{
+    LoadInst *Len = B.CreateLoad(B.getInt64Ty(), Arr, "len");
+    Len->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(*TheContext, {}));
+    return Len;
+}
+
+/// getRuntimeFunction - Declare the runtime library function Name in the
+/// current module.
+static Function *getRuntimeFunction(StringRef Name, FunctionType *FT)
+{
+    if (Function *F = TheModule->getFunction(Name))
+        return F;
+
+    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+    F->setDoesNotThrow();
+    return F;
+}
+
+/// emitBoundsCheck - Exit through the runtime's error handler unless Idx is a
+/// valid index into an array of length Len.  KnownInBounds, if given, is a
+/// loop-invariant condition under which the check is known to pass.
+static void emitBoundsCheck(Value *Idx, Value *Len, Value *KnownInBounds)
+{
+    ++NumBoundsChecks;
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // One unsigned compare also catches negative indexes.
+    Value *InBounds = Builder->CreateICmpULT(Idx, Len, "inbounds");
+    if (KnownInBounds)
+        InBounds = Builder->CreateOr(KnownInBounds, InBounds, "inbounds");
+
+    BasicBlock *FailBB = BasicBlock::Create(*TheContext, "oob", TheFunction);
+    BasicBlock *OkBB = BasicBlock::Create(*TheContext, "inbounds", TheFunction);
+    Builder->CreateCondBr(InBounds, OkBB, FailBB);
+
+    Builder->SetInsertPoint(FailBB);
+    Type *Int64Ty = Builder->getInt64Ty();
+    Function *IndexError =
+        getRuntimeFunction("kal_index_error", FunctionType::get(Builder->getVoidTy(), {Int64Ty, Int64Ty}, false));
+    IndexError->setDoesNotReturn();
+    IndexError->addFnAttr(Attribute::Cold);
+    Builder->CreateCall(IndexError, {Idx, Len});
+    Builder->CreateUnreachable();
+
+    Builder->SetInsertPoint(OkBB);
+}
+
+/// emitBound - If Cond has the form "Var < Bound" or "Var <= Bound", emit the
+/// bound ahead of the loop and remember it.  The bound is evaluated again
+/// every iteration, so only side-effect free bounds are evaluated here, and
+/// finish() later checks that no local they read is assigned in the loop.
+/// Returns false on error.
+bool CountedLoop::emitBound(BinaryExprAST &Cond)
+{
+    if (Cond.getOp() != '<' && Cond.getOp() != tok_le)
+        return true;
+    auto *CondVar = dyn_cast<VariableExprAST>(&Cond.getLHS());
+    if (!CondVar || NamedValues[CondVar->getName()] != Var)
+        return true;
+
+    FunctionEffects FE;
+    Cond.getRHS().collectEffects("", FE);
+    if (FE.WritesMemory || FE.MayUnwind || FE.MayNotReturn || FE.MayRecurse)
+        return true;
+
+    BasicBlock *BB = Builder->GetInsertBlock();
+    Instruction *Last = BB->empty() ? nullptr : &BB->back();
+    Value *V = Cond.getRHS().codegen();
+    if (!V)
+        return false;
+    if (Builder->GetInsertBlock() != BB || V->getType() != Var->getAllocatedType())
+        return true;
+
+    // Any memory the bound reads must be a local or an array length.
+    for (Instruction &I : make_range(Last ? std::next(Last->getIterator()) : BB->begin(), BB->end()))
+    {
+        if (auto *LI = dyn_cast<LoadInst>(&I))
+        {
+            if (auto *A = dyn_cast<AllocaInst>(LI->getPointerOperand()); A && A != Var)
+                BoundVars.push_back(A);
+            else if (!LI->hasMetadata(LLVMContext::MD_invariant_load))
+                return true;
+        }
+        else if (I.mayReadOrWriteMemory())
+            return true;
+    }
+
+    Bound = V;
+    Inclusive = Cond.getOp() == tok_le;
+    return true;
+}
+
+/// getInBounds - The condition, evaluated before the loop, under which
+/// indexing the array or collection in local Array by the loop variable is
+/// always safe.
+Value *CountedLoop::getInBounds(AllocaInst *Array)
+{
+    Value *&Cond = InBounds[Array];
+    if (Cond)
+        return Cond;
+
+    IRBuilder<> B(Entry);
+    Value *Arr = getStoragePtr(B, B.CreateLoad(Array->getAllocatedType(), Array, Array->getName()));
+    Value *Len = emitArrayLength(B, Arr);
+    Value *StartOk = B.CreateAnd(B.CreateICmpSGE(Start, B.getInt64(0)), B.CreateICmpSLT(Start, Len));
+    Value *BoundOk = B.CreateICmpSLT(Bound, Inclusive ? B.CreateSub(Len, B.getInt64(1)) : Len);
+    return Cond = B.CreateAnd(StartOk, BoundOk, "loop.inbounds");
+}
+
+/// finish - Called once the loop from LoopBB to the end of the function has
+/// been emitted, with the step it used.  Drops every precomputed fact that
+/// the loop invalidates by assigning to the variables it depends on.  Loops
+/// that keep the counter in a register copy it into Var for the body; that
+/// copy, CounterCopy, is not an assignment.
+void CountedLoop::finish(BasicBlock *LoopBB, Value *StepVal, StoreInst *CounterCopy)
+{
+    std::set<Value *> Assigned;
+    for (BasicBlock &BB : make_range(LoopBB->getIterator(), LoopBB->getParent()->end()))
+        for (Instruction &I : BB)
+            if (auto *SI = dyn_cast<StoreInst>(&I); SI && SI != CounterCopy)
+                Assigned.insert(SI->getPointerOperand());
+
+    auto *Step = dyn_cast<ConstantInt>(StepVal);
+    bool Valid = Step && Step->isOne() && !Assigned.count(Var);
+    for (AllocaInst *A : BoundVars)
+        Valid &= !Assigned.count(A);
+
+    for (auto &[Array, Cond] : InBounds)
+    {
+        if (!Valid || Assigned.count(Array))
+            Cond->replaceAllUsesWith(ConstantInt::getFalse(*TheContext));
+        else
+            NumBoundsChecksHoisted += Cond->getNumUses();
+    }
+}
+
+Value *ExprAST::codegenCond()
+{
+    Value *V = codegen();
+    if (!V)
+        return nullptr;
+
+    // Convert condition to a bool by comparing non-equal to zero.
+    return convertTo(V, ValueType::Bool, /*Explicit=*/true);
+}
+
+/// emitReturn - Return V from the current function, converting it to the
+/// declared return type.
+static bool emitReturn(Value *V)
+{
+    V = convertTo(V, CurFnProto->getReturnType());
+    if (!V)
+        return false;
+    Builder->CreateRet(V);
+    return true;
+}
+
+bool ExprAST::codegenReturn()
+{
+    Value *V = codegen();
+    return V && emitReturn(V);
+}
+
+Value *NumberExprAST::codegen()
+{
+    switch (Ty)
+    {
+    case ValueType::Bool:
+        return ConstantInt::get(Type::getInt1Ty(*TheContext), Val != 0);
+    case ValueType::Int:
+        return ConstantInt::getSigned(Type::getInt64Ty(*TheContext), (int64_t)Val);
+    default:
+        break;
+    }
+    return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+/// getGlobalConstant - The constant stored in memory as Bits for a value of
+/// type Ty.
+static Constant *getGlobalConstant(ValueType Ty, uint64_t Bits)
+{
+    switch (Ty)
+    {
+    case ValueType::Bool:
+        return ConstantInt::getBool(*TheContext, Bits != 0);
+    case ValueType::Int:
+        return ConstantInt::get(Type::getInt64Ty(*TheContext), Bits);
+    case ValueType::Double:
+        return ConstantFP::get(*TheContext, APFloat(llvm::bit_cast<double>(Bits)));
+    default:
+        break;
+    }
+
+    // Arrays and collections of records point into the runtime's heap.
+    Constant *Ptr = ConstantExpr::getIntToPtr(ConstantInt::get(Type::getInt64Ty(*TheContext), Bits),
+                                              PointerType::getUnqual(*TheContext));
+    if (isRecordCollection(Ty))
+        return ConstantStruct::get(cast<StructType>(getLLVMType(Ty)), Ptr);
+    return Ptr;
+}
+
+/// getGlobalVariable - Declare global Name in the current module.  Only the
+/// module of the "global" declaration defines it; every other module refers
+/// to that definition by name when the JIT links it.
+static GlobalVariable *getGlobalVariable(const std::string &Name, const GlobalDecl &G)
+{
+    // Globals share the JIT's symbol table with functions, so they're named
+    // apart from every possible function name.
+    std::string SymName = "global." + Name;
+    if (GlobalVariable *GV = TheModule->getNamedGlobal(SymName))
+        return GV;
+    return new GlobalVariable(*TheModule, getLLVMType(G.Ty), /*isConstant=*/false, GlobalValue::ExternalLinkage,
+                              nullptr, SymName);
+}
+
+Value *VariableExprAST::codegen()
+{
+    // Look this variable up in the function.
+    AllocaInst *A = NamedValues[Name];
+    if (A)
+        return Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+
+    // Consts fold to their value, globals load from memory.
+    if (!Global)
+        return LogErrorV("Unknown variable name");
+    if (Global->IsConst)
+        return getGlobalConstant(Global->Ty, Global->Bits);
+    return Builder->CreateLoad(getLLVMType(Global->Ty), getGlobalVariable(Name, *Global), Name.c_str());
+}
+
+Value *IndexExprAST::codegen()
+{
+    Value *Agg = Array->codegen();
+    if (!Agg)
+        return nullptr;
+
+    ValueType Ty = getValueType(Agg->getType());
+    if (isVector(Ty))
+    {
+        Value *Lane = codegenLaneIndex(Ty);
+        return Lane ? Builder->CreateExtractElement(Agg, Lane, "lane") : nullptr;
+    }
+
+    Value *Addr = codegenAddress(Agg);
+    if (!Addr)
+        return nullptr;
+    return Builder->CreateLoad(getLLVMType(getElementType(Ty)), Addr, "elt");
+}
+
+/// codegenStore - Emit "Array[Index] = Val", converting Val to the element
+/// type.
+Value *IndexExprAST::codegenStore(Value *Val)
+{
+    Value *Agg = Array->codegen();
+    if (!Agg)
+        return nullptr;
+
+    ValueType Ty = getValueType(Agg->getType());
+    if (!(Val = convertTo(Val, getElementType(Ty))))
+        return nullptr;
+    if (isVector(Ty))
+    {
+        // Vectors are values, so setting a lane writes a new one back to the
+        // variable that held the old one.
+        auto *Var = dyn_cast<VariableExprAST>(Array.get());
+        if (!Var)
+            return LogErrorV("only lanes of vector variables can be assigned");
+        Value *Lane = codegenLaneIndex(Ty);
+        if (!Lane)
+            return nullptr;
+        Builder->CreateStore(Builder->CreateInsertElement(Agg, Val, Lane, "vec"), NamedValues[Var->getName()]);
+        return Val;
+    }
+
+    Value *Addr = codegenAddress(Agg);
+    if (!Addr)
+        return nullptr;
+    Builder->CreateStore(Val, Addr);
+    return Val;
+}
+
+/// codegenLaneIndex - Emit the index of a lane of a vector of type VecTy.
+/// Constant indexes are checked here, others at run time.
+Value *IndexExprAST::codegenLaneIndex(ValueType VecTy)
+{
+    Value *Idx = Index->codegen();
+    if (!Idx || !(Idx = convertTo(Idx, ValueType::Int)))
+        return nullptr;
+
+    Value *Width = Builder->getInt64(getVecWidth(VecTy));
+    if (auto *C = dyn_cast<ConstantInt>(Idx))
+    {
+        if (C->getValue().uge(getVecWidth(VecTy)))
+            return LogErrorV("vector lane index out of range");
+        return Idx;
+    }
+    emitBoundsCheck(Idx, Width, nullptr);
+    return Idx;
+}
+
+/// getElementType - The type of the element or field this reads from an
+/// aggregate of type Ty.
+ValueType IndexExprAST::getElementType(ValueType Ty) const
+{
+    if (isRecordCollection(Ty))
+    {
+        const RecordDecl &R = getRecord(Ty);
+        int FieldIdx = R.getFieldIndex(Field);
+        if (FieldIdx >= 0)
+            return R.FieldTypes[FieldIdx];
+    }
+    return ValueType::Double;
+}
+
+/// codegenAddress - Emit the address of the element of array Agg, or of the
+/// field of an element of collection Agg, after checking the index against
+/// the length.
+Value *IndexExprAST::codegenAddress(Value *Agg)
+{
+    ValueType Ty = getValueType(Agg->getType());
+    int FieldIdx = -1;
+    if (isRecordCollection(Ty))
+    {
+        if (Field.empty())
+            return LogErrorV("elements of record collections are accessed by field, like \"ps[i].x\"");
+        if ((FieldIdx = getRecord(Ty).getFieldIndex(Field)) < 0)
+            return LogErrorV("unknown record field");
+    }
+    else if (Ty != ValueType::Array)
+        return LogErrorV("only arrays, vectors and record collections can be indexed");
+    else if (!Field.empty())
+        return LogErrorV("only elements of record collections have fields");
+
+    Value *Idx = Index->codegen();
+    if (!Idx || !(Idx = convertTo(Idx, ValueType::Int)))
+        return nullptr;
+
+    // Indexing a local array by the variable of an enclosing counted loop may
+    // be known safe for the whole loop.  Globals can change behind the loop's
+    // back, in any call it makes, so they are always checked.
+    Value *KnownInBounds = nullptr;
+    auto *ArrVar = dyn_cast<VariableExprAST>(Array.get());
+    auto *IdxVar = dyn_cast<VariableExprAST>(Index.get());
+    if (ArrVar && IdxVar && NamedValues[ArrVar->getName()])
+    {
+        AllocaInst *IdxA = NamedValues[IdxVar->getName()];
+        for (auto It = CountedLoops.rbegin(), E = CountedLoops.rend(); It != E; ++It)
+            if ((*It)->Var == IdxA)
+            {
+                if ((*It)->Bound)
+                    KnownInBounds = (*It)->getInBounds(NamedValues[ArrVar->getName()]);
+                break;
+            }
+    }
+
+    Value *Arr = getStoragePtr(*Builder, Agg);
+    Value *Len = emitArrayLength(*Builder, Arr);
+    emitBoundsCheck(Idx, Len, KnownInBounds);
+
+    Value *Slot = Idx;
+    if (FieldIdx >= 0)
+    {
+        // Struct-of-arrays keeps each field contiguous, so field f of element
+        // i is in slot f * len + i and a loop over one field walks memory
+        // densely.  Array-of-structs keeps each element's fields together, so
+        // a field repeats every NumFields slots.
+        const RecordDecl &R = getRecord(Ty);
+        Value *F = Builder->getInt64(FieldIdx);
+        if (R.AoS)
+            Slot = Builder->CreateAdd(Builder->CreateNUWMul(Idx, Builder->getInt64(R.Fields.size())), F, "slot",
+                                      /*HasNUW=*/true, /*HasNSW=*/true);
+        else
+            Slot = Builder->CreateAdd(Builder->CreateNUWMul(F, Len), Idx, "slot", /*HasNUW=*/true, /*HasNSW=*/true);
+    }
+    Value *Indices[] = {Builder->getInt32(0), Builder->getInt32(1), Slot};
+    return Builder->CreateInBoundsGEP(getArrayStorageType(), Arr, Indices, "eltaddr");
+}
+
+Value *VecExprAST::codegen()
+{
+    std::vector<Value *> LaneVals;
+    for (auto &Lane : Lanes)
+    {
+        Value *V = Lane->codegen();
+        if (!V || !(V = convertTo(V, ValueType::Double)))
+            return nullptr;
+        LaneVals.push_back(V);
+    }
+
+    if (LaneVals.size() == 1)
+        return Builder->CreateVectorSplat(getVecWidth(Ty), LaneVals[0], "splat");
+
+    Value *Vec = PoisonValue::get(getLLVMType(Ty));
+    for (unsigned i = 0, e = LaneVals.size(); i != e; ++i)
+        Vec = Builder->CreateInsertElement(Vec, LaneVals[i], Builder->getInt64(i), "vec");
+    return Vec;
+}
+
+Value *ShuffleExprAST::codegen()
+{
+    Value *V = Operand->codegen();
+    if (!V)
+        return nullptr;
+    ValueType Ty = getValueType(V->getType());
+    if (!isVector(Ty))
+        return LogErrorV("shuffle expects a vector");
+    for (int Lane : Mask)
+        if (Lane < 0 || (unsigned)Lane >= getVecWidth(Ty))
+            return LogErrorV("shuffle lane index out of range");
+    return Builder->CreateShuffleVector(V, Mask, "shuffle");
+}
+
+Value *ReduceExprAST::codegen()
+{
+    Value *V = Operand->codegen();
+    if (!V)
+        return nullptr;
+    if (!isVector(getValueType(V->getType())))
+        return LogErrorV("horizontal reductions expect a vector");
+
+    switch (Reduction)
+    {
+    case RK_Sum:
+    {
+        // Allowing reassociation lets the lanes be added pairwise, in
+        // log2(width) vector steps, rather than strictly left to right.
+        IRBuilderBase::FastMathFlagGuard Guard(*Builder);
+        FastMathFlags FMF;
+        FMF.setAllowReassoc();
+        Builder->setFastMathFlags(FMF);
+        return Builder->CreateFAddReduce(ConstantFP::get(*TheContext, APFloat(-0.0)), V);
+    }
+    case RK_Min:
+        return Builder->CreateFPMinReduce(V);
+    case RK_Max:
+        return Builder->CreateFPMaxReduce(V);
+    }
+    llvm_unreachable("unknown reduction");
+}
+
+Value *NewArrayExprAST::codegen()
+{
+    Value *Len = Length->codegen();
+    if (!Len || !(Len = convertTo(Len, ValueType::Int)))
+        return nullptr;
+
+    // Arrays have one slot per element, collections of records one per field.
+    Type *I64 = Builder->getInt64Ty();
+    Function *ArrayNew =
+        getRuntimeFunction("kal_array_new", FunctionType::get(getLLVMType(ValueType::Array), {I64, I64}, false));
+    ArrayNew->addRetAttr(Attribute::NoAlias);
+    unsigned Stride = isRecordCollection(Ty) ? getRecord(Ty).Fields.size() : 1;
+    Value *Storage = Builder->CreateCall(ArrayNew, {Len, Builder->getInt64(Stride)}, "arr");
+    if (!isRecordCollection(Ty))
+        return Storage;
+    return Builder->CreateInsertValue(PoisonValue::get(getLLVMType(Ty)), Storage, 0, "records");
+}
+
+Value *LenExprAST::codegen()
+{
+    Value *Arr = Array->codegen();
+    if (!Arr)
+        return nullptr;
+    ValueType Ty = getValueType(Arr->getType());
+    if (Ty != ValueType::Array && !isRecordCollection(Ty))
+        return LogErrorV("len() expects an array or a record collection");
+    return emitArrayLength(*Builder, getStoragePtr(*Builder, Arr));
+}
+
+Value *UnaryExprAST::codegen()
+{
+    Value *OperandV = Operand->codegen();
+    if (!OperandV)
+        return nullptr;
+
+    Function *F = getFunction(std::string("unary") + Opcode);
+    if (!F)
+        return LogErrorV("Unknown unary operator");
+
+    OperandV = convertTo(OperandV, getValueType(F->getArg(0)->getType()));
+    if (!OperandV)
+        return nullptr;
+
+    return Builder->CreateCall(F, OperandV, "unop");
+}
+
+Value *BinaryExprAST::codegen()
+{
+    // Special case '=' because we don't want to emit the LHS as an expression.
+    if (Op == '=')
+    {
+        // Storing to an array element or vector lane.
+        if (auto *LHSI = dyn_cast<IndexExprAST>(LHS.get()))
+        {
+            Value *Val = RHS->codegen();
+            return Val ? LHSI->codegenStore(Val) : nullptr;
+        }
+
+        // Otherwise the LHS has to be an identifier.
+        auto *LHSE = dyn_cast<VariableExprAST>(LHS.get());
+        if (!LHSE)
+            return LogErrorV("destination of '=' must be a variable or array element");
+        // Codegen the RHS.
+        Value *Val = RHS->codegen();
+        if (!Val)
+            return nullptr;
+
+        // Look up the name, falling back to a global.
+        Value *Variable = NamedValues[LHSE->getName()];
+        ValueType VarTy;
+        if (Variable)
+            VarTy = getValueType(cast<AllocaInst>(Variable)->getAllocatedType());
+        else if (const GlobalDecl *G = LHSE->getGlobal())
+        {
+            if (G->IsConst)
+                return LogErrorV("cannot assign to a const");
+            Variable = getGlobalVariable(LHSE->getName(), *G);
+            VarTy = G->Ty;
+        }
+        else
+            return LogErrorV("Unknown variable name");
+
+        Val = convertTo(Val, VarTy);
+        if (!Val)
+            return nullptr;
+
+        Builder->CreateStore(Val, Variable);
+        return Val;
+    }
+
+    // Comparisons and logical operators produce a bool, which stays an i1
+    // until a use needs it converted.
+    if (isBooleanOp(Op))
+        return codegenCond();
+
+    Value *L = LHS->codegen();
+    Value *R = RHS->codegen();
+    if (!L || !R)
+        return nullptr;
+
+    if (isBuiltinBinop(Op))
+    {
+        ValueType LTy = getValueType(L->getType()), RTy = getValueType(R->getType());
+        ValueType Ty = getBuiltinBinopType(Op, LTy, RTy);
+        if (isVector(LTy) || isVector(RTy))
+        {
+            // Element-wise, with a scalar operand applying to every lane.
+            Ty = isVector(LTy) ? LTy : RTy;
+            L = splatTo(L, Ty);
+            R = splatTo(R, Ty);
+        }
+        else if (isScalar(Ty))
+        {
+            L = convertTo(L, Ty);
+            R = convertTo(R, Ty);
+        }
+        else
+            return LogErrorV("arithmetic on arrays is not supported");
+        if (!L || !R)
+            return nullptr;
+
+        if (Ty == ValueType::Int)
+        {
+            switch (Op)
+            {
+            case '+':
+                return Builder->CreateAdd(L, R, "addtmp");
+            case '-':
+                return Builder->CreateSub(L, R, "subtmp");
+            default:
+                assert(Op == '*' && "unexpected int operator");
+                return Builder->CreateMul(L, R, "multmp");
+            }
+        }
+
+        switch (Op)
+        {
+        case '+':
+            return Builder->CreateFAdd(L, R, "addtmp");
+        case '-':
+            return Builder->CreateFSub(L, R, "subtmp");
+        case '*':
+            return Builder->CreateFMul(L, R, "multmp");
+        default:
+            assert(Op == '/' && "unexpected double operator");
+            return Builder->CreateFDiv(L, R, "divtmp");
+        }
+    }
+
+    // If it wasn't a builtin binary operator, it must be a user defined one. Emit
+    // a call to it.
+    Function *F = getFunction(std::string("binary") + (char)Op);
+    assert(F && "binary operator not found!");
+
+    L = convertTo(L, getValueType(F->getArg(0)->getType()));
+    R = convertTo(R, getValueType(F->getArg(1)->getType()));
+    if (!L || !R)
+        return nullptr;
+
+    Value *Ops[] = {L, R};
+    return Builder->CreateCall(F, Ops, "binop");
+}
+
+Value *BinaryExprAST::codegenCond()
+{
+    if (Op == tok_and || Op == tok_or)
+        return codegenShortCircuit();
+    if (!isBooleanOp(Op))
+        return ExprAST::codegenCond();
+
+    Value *L = LHS->codegen();
+    Value *R = RHS->codegen();
+    if (!L || !R)
+        return nullptr;
+
+    // Compare in the wider of the two operand types, and never narrower than
+    // int so that bools compare as 0 and 1.
+    ValueType Ty = std::max({getValueType(L->getType()), getValueType(R->getType()), ValueType::Int});
+    if (!isScalar(Ty))
+        return LogErrorV("only numbers can be compared");
+    L = convertTo(L, Ty);
+    R = convertTo(R, Ty);
+    if (!L || !R)
+        return nullptr;
+
+    if (Ty == ValueType::Int)
+    {
+        switch (Op)
+        {
+        case '<':
+            return Builder->CreateICmpSLT(L, R, "cmptmp");
+        case '>':
+            return Builder->CreateICmpSGT(L, R, "cmptmp");
+        case tok_le:
+            return Builder->CreateICmpSLE(L, R, "cmptmp");
+        case tok_ge:
+            return Builder->CreateICmpSGE(L, R, "cmptmp");
+        case tok_eq:
+            return Builder->CreateICmpEQ(L, R, "cmptmp");
+        default:
+            assert(Op == tok_ne && "unexpected boolean operator");
+            return Builder->CreateICmpNE(L, R, "cmptmp");
+        }
+    }
+
+    switch (Op)
+    {
+    case '<':
+        return Builder->CreateFCmpULT(L, R, "cmptmp");
+    case '>':
+        return Builder->CreateFCmpUGT(L, R, "cmptmp");
+    case tok_le:
+        return Builder->CreateFCmpULE(L, R, "cmptmp");
+    case tok_ge:
+        return Builder->CreateFCmpUGE(L, R, "cmptmp");
+    case tok_eq:
+        return Builder->CreateFCmpOEQ(L, R, "cmptmp");
+    default:
+        assert(Op == tok_ne && "unexpected boolean operator");
+        return Builder->CreateFCmpUNE(L, R, "cmptmp");
+    }
+}
+
+// Output 'a && b' as:
+//   lhs = cond(a)
+//   br lhs, rhs, end         ('a || b' swaps the successors)
+// rhs:
+//   rhsval = cond(b)
+//   br end
+// end:
+//   phi [lhs is 0 for &&, 1 for ||, entry], [rhsval, rhs]
+Value *BinaryExprAST::codegenShortCircuit()
+{
+    Value *L = LHS->codegenCond();
+    if (!L)
+        return nullptr;
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *EntryBB = Builder->GetInsertBlock();
+    BasicBlock *RHSBB = BasicBlock::Create(*TheContext, "logic.rhs", TheFunction);
+    BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "logic.end");
+
+    // Only evaluate the RHS if the LHS didn't already decide the result.
+    bool IsAnd = Op == tok_and;
+    if (IsAnd)
+        Builder->CreateCondBr(L, RHSBB, MergeBB);
+    else
+        Builder->CreateCondBr(L, MergeBB, RHSBB);
+
+    Builder->SetInsertPoint(RHSBB);
+    Value *R = RHS->codegenCond();
+    if (!R)
+        return nullptr;
+    Builder->CreateBr(MergeBB);
+    // Codegen of the RHS can change the current block, update RHSBB for the PHI.
+    RHSBB = Builder->GetInsertBlock();
+
+    TheFunction->insert(TheFunction->end(), MergeBB);
+    Builder->SetInsertPoint(MergeBB);
+    PHINode *PN = Builder->CreatePHI(Type::getInt1Ty(*TheContext), 2, "logictmp");
+    PN->addIncoming(ConstantInt::get(Type::getInt1Ty(*TheContext), !IsAnd), EntryBB);
+    PN->addIncoming(R, RHSBB);
+    return PN;
+}
+
+Value *CallExprAST::codegen()
+{
+    // Look up the name in the global module table.
+    Function *CalleeF = getFunction(Callee);
+    if (!CalleeF)
+        return LogErrorV("Unknown function referenced");
+
+    // If argument mismatch error.
+    if (CalleeF->arg_size() != Args.size())
+        return LogErrorV("Incorrect # arguments passed");
+
+    // Tail position is handled by codegenReturn(); any self call reaching here
+    // stays a real call, which a tailrec function promised never to make.
+    if (CurFnProto->isTailRec() && Callee == CurFnProto->getName())
+        return LogErrorV("recursive call in a tailrec function is not in tail position");
+
+    std::vector<Value *> ArgsV;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    {
+        Value *ArgV = Args[i]->codegen();
+        if (!ArgV)
+            return nullptr;
+        ArgsV.push_back(convertTo(ArgV, getValueType(CalleeF->getArg(i)->getType())));
+        if (!ArgsV.back())
+            return nullptr;
+    }
+
+    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+bool CallExprAST::codegenReturn()
+{
+    // A self call in tail position is a jump back to the top of the function
+    // with new argument values.  Evaluate all of them before storing any, as
+    // they may read the current ones.
+    if (Callee == CurFnProto->getName() && Args.size() == CurFnArgAllocas.size())
+    {
+        std::vector<Value *> ArgsV;
+        for (unsigned i = 0, e = Args.size(); i != e; ++i)
+        {
+            Value *ArgV = Args[i]->codegen();
+            if (!ArgV)
+                return false;
+            ArgsV.push_back(convertTo(ArgV, getValueType(CurFnArgAllocas[i]->getAllocatedType())));
+            if (!ArgsV.back())
+                return false;
+        }
+        for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+            Builder->CreateStore(ArgsV[i], CurFnArgAllocas[i]);
+        Builder->CreateBr(TailRecurseBB);
+        ++NumTailCallsToLoops;
+        return true;
+    }
+
+    Value *V = codegen();
+    if (!V)
+        return false;
+
+    // Any other call directly followed by the return is a tail call.  When the
+    // signatures match exactly, musttail guarantees it won't grow the stack.
+    auto *CI = cast<CallInst>(V);
+    if (CI->getFunctionType() == Builder->GetInsertBlock()->getParent()->getFunctionType())
+    {
+        CI->setTailCallKind(CallInst::TCK_MustTail);
+        ++NumMustTailCalls;
+    }
+    else
+        CI->setTailCallKind(CallInst::TCK_Tail);
+    return emitReturn(CI);
+}
+
+Value *CastExprAST::codegen()
+{
+    Value *V = Operand->codegen();
+    if (!V)
+        return nullptr;
+    return convertTo(V, To, /*Explicit=*/true);
 }
 
-/// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str)
-{
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
-}
+Value *IfExprAST::codegen()
+{
+    Value *CondV = Cond->codegenCond();
+    if (!CondV)
+        return nullptr;
+
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // Create blocks for the then and else cases.  Insert the 'then' block at the
+    // end of the function.
+    BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+    BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+    BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+
+    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+    // Emit then value.
+    Builder->SetInsertPoint(ThenBB);
+
+    Value *ThenV = Then->codegen();
+    if (!ThenV)
+        return nullptr;
+
+    // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
+    ThenBB = Builder->GetInsertBlock();
+
+    // Emit else block.
+    TheFunction->insert(TheFunction->end(), ElseBB);
+    Builder->SetInsertPoint(ElseBB);
+
+    Value *ElseV = Else->codegen();
+    if (!ElseV)
+        return nullptr;
+
+    // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
+    ElseBB = Builder->GetInsertBlock();
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str)
-{
-    LogError(Str);
-    return nullptr;
-}
+    // An arm that ends in break or return yields no value, and takes the other
+    // arm's type.  Otherwise the if yields the wider of two numbers, and arms
+    // of any other types must agree.
+    bool ThenDead = pred_empty(ThenBB), ElseDead = pred_empty(ElseBB);
+    ValueType ThenTy = getValueType(ThenV->getType()), ElseTy = getValueType(ElseV->getType());
+    if (ThenDead)
+        ThenTy = ElseTy;
+    else if (ElseDead)
+        ElseTy = ThenTy;
+    if (ThenTy != ElseTy && (!isScalar(ThenTy) || !isScalar(ElseTy)))
+    {
+        std::string Msg =
+            std::string("if arms have different types: ") + getTypeName(ThenTy) + " and " + getTypeName(ElseTy);
+        return LogErrorV(Msg.c_str());
+    }
+    ValueType Ty = std::max(ThenTy, ElseTy);
 
-static std::unique_ptr<ExprAST> ParseExpression();
+    // Now that the type is known, convert each arm at the end of its own block
+    // and branch to the merge block.
+    Builder->SetInsertPoint(ThenBB);
+    ThenV = ThenDead ? PoisonValue::get(getLLVMType(Ty)) : convertTo(ThenV, Ty);
+    if (!ThenV)
+        return nullptr;
+    Builder->CreateBr(MergeBB);
+    Builder->SetInsertPoint(ElseBB);
+    ElseV = ElseDead ? PoisonValue::get(getLLVMType(Ty)) : convertTo(ElseV, Ty);
+    if (!ElseV)
+        return nullptr;
+    Builder->CreateBr(MergeBB);
 
-/// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr()
-{
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
-    getNextToken(); // consume the number
-    return std::move(Result);
+    // Emit merge block.
+    TheFunction->insert(TheFunction->end(), MergeBB);
+    Builder->SetInsertPoint(MergeBB);
+    PHINode *PN = Builder->CreatePHI(getLLVMType(Ty), 2, "iftmp");
+
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
 }
 
-/// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr()
+// In tail position each arm returns on its own, so calls in the arms stay
+// directly followed by a return instead of flowing into a phi.
+bool IfExprAST::codegenReturn()
 {
-    getNextToken(); // eat (.
-    auto V = ParseExpression();
-    if (!V)
-        return nullptr;
+    Value *CondV = Cond->codegenCond();
+    if (!CondV)
+        return false;
 
-    if (CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken(); // eat ).
-    return V;
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
+    BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+    Builder->SetInsertPoint(ThenBB);
+    if (!Then->codegenReturn())
+        return false;
+
+    TheFunction->insert(TheFunction->end(), ElseBB);
+    Builder->SetInsertPoint(ElseBB);
+    return Else->codegenReturn();
 }
 
-/// identifierexpr
-///   ::= identifier
-///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr()
+// Output for-loop as:
+//   var = alloca <type of var>
+//   ...
+//   start = startexpr
+//   store start -> var
+//   goto loop
+// loop:
+//   ...
+//   bodyexpr
+//   ...
+// loopend:
+//   step = stepexpr
+//   endcond = endexpr
+//
+//   curvar = load var
+//   nextvar = curvar + step
+//   store nextvar -> var
+//   br endcond, loop, endloop
+// outloop:
+Value *ForExprAST::codegen()
 {
-    std::string IdName = IdentifierStr;
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    if (!isScalar(VarType))
+        return LogErrorV("for loop variable must be a number");
 
-    getNextToken(); // eat identifier.
+    // Create an alloca for the variable in the entry block.
+    Type *VarTy = getLLVMType(VarType);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
 
-    if (CurTok != '(') // Simple variable ref.
-        return std::make_unique<VariableExprAST>(IdName);
+    // Emit the start code first, without 'variable' in scope.
+    Value *StartVal = Start->codegen();
+    if (!StartVal || !(StartVal = convertTo(StartVal, VarType)))
+        return nullptr;
 
-    // Call.
-    getNextToken(); // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    if (CurTok != ')')
-    {
-        while (true)
-        {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
+    // Store the value into the alloca.
+    Builder->CreateStore(StartVal, Alloca);
 
-            if (CurTok == ')')
-                break;
+    // Within the loop, the variable is defined equal to the PHI node.  If it
+    // shadows an existing variable, we have to restore it, so save it now.
+    AllocaInst *OldVal = NamedValues[VarName];
+    NamedValues[VarName] = Alloca;
 
-            if (CurTok != ',')
-                return LogError("Expected ')' or ',' in argument list");
-            getNextToken();
-        }
-    }
+    // Array indexes by an int variable counting up to a fixed bound can be
+    // checked once, before the loop.
+    CountedLoop Counted(Alloca, StartVal);
+    if (auto *Cond = dyn_cast<BinaryExprAST>(End.get()); Cond && VarType == ValueType::Int)
+        if (!Counted.emitBound(*Cond))
+            return nullptr;
 
-    // Eat the ')'.
-    getNextToken();
+    // Make the new basic block for the loop header, inserting after current
+    // block.
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
 
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
-}
+    // Insert an explicit fall through from the current block to the LoopBB.
+    Counted.Entry = Builder->CreateBr(LoopBB);
 
-/// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr()
-{
-    getNextToken(); // eat the if.
+    // Start insertion in LoopBB.
+    Builder->SetInsertPoint(LoopBB);
+    CountedLoops.push_back(&Counted);
 
-    // condition.
-    auto Cond = ParseExpression();
-    if (!Cond)
+    // The "after loop" block exists before the body, as break branches to it.
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop");
+    LoopExits.push_back(AfterBB);
+
+    // Emit the body of the loop.  This, like any other expr, can change the
+    // current BB.  Note that we ignore the value computed by the body, but don't
+    // allow an error.
+    if (!Body->codegen())
         return nullptr;
+    LoopExits.pop_back();
 
-    if (CurTok != tok_then)
-        return LogError("expected then");
-    getNextToken(); // eat the then
+    // Emit the step value.
+    Value *StepVal = nullptr;
+    if (Step)
+    {
+        StepVal = Step->codegen();
+        if (!StepVal || !(StepVal = convertTo(StepVal, VarType)))
+            return nullptr;
+    }
+    else if (VarType == ValueType::Double)
+    {
+        // If not specified, use 1.0.
+        StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    }
+    else
+    {
+        StepVal = ConstantInt::get(VarTy, 1);
+    }
 
-    auto Then = ParseExpression();
-    if (!Then)
+    // Compute the end condition.
+    Value *EndCond = End->codegenCond();
+    if (!EndCond)
         return nullptr;
 
-    if (CurTok != tok_else)
-        return LogError("expected else");
+    CountedLoops.pop_back();
+    Counted.finish(LoopBB, StepVal);
 
-    getNextToken();
+    // Reload, increment, and restore the alloca.  This handles the case where
+    // the body of the loop mutates the variable.
+    Value *CurVar = Builder->CreateLoad(VarTy, Alloca, VarName.c_str());
+    Value *NextVar = VarType == ValueType::Double ? Builder->CreateFAdd(CurVar, StepVal, "nextvar")
+                                                  : Builder->CreateNSWAdd(CurVar, StepVal, "nextvar");
+    Builder->CreateStore(NextVar, Alloca);
 
-    auto Else = ParseExpression();
-    if (!Else)
-        return nullptr;
+    // Insert the conditional branch into the end of LoopEndBB.
+    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
 
-    return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then), std::move(Else));
+    // Any new code will be inserted in AfterBB.
+    TheFunction->insert(TheFunction->end(), AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+
+    // Restore the unshadowed variable.
+    if (OldVal)
+        NamedValues[VarName] = OldVal;
+    else
+        NamedValues.erase(VarName);
+
+    // for expr always returns 0.0.
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr()
+// Output while-loop already rotated, with the condition tested once to guard
+// the loop and again at the bottom of the body:
+//   cond = condexpr
+//   br cond, loop, afterloop
+// loop:
+//   bodyexpr
+//   cond = condexpr
+//   br cond, loop, afterloop
+// afterloop:
+// The latch is the only exiting block, as LoopRotate would leave it, so LICM
+// and the vectorizer see the same shape as for a for loop.
+Value *WhileExprAST::codegen()
 {
-    getNextToken(); // eat the for.
-
-    if (CurTok != tok_identifier)
-        return LogError("expected identifier after for");
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
 
-    std::string IdName = IdentifierStr;
-    getNextToken(); // eat identifier.
+    Value *CondV = Cond->codegenCond();
+    if (!CondV)
+        return nullptr;
 
-    if (CurTok != '=')
-        return LogError("expected '=' after for");
-    getNextToken(); // eat '='.
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop");
+    Builder->CreateCondBr(CondV, LoopBB, AfterBB);
 
-    auto Start = ParseExpression();
-    if (!Start)
+    Builder->SetInsertPoint(LoopBB);
+    LoopExits.push_back(AfterBB);
+    if (!Body->codegen())
         return nullptr;
-    if (CurTok != ',')
-        return LogError("expected ',' after for start value");
-    getNextToken();
+    LoopExits.pop_back();
 
-    auto End = ParseExpression();
-    if (!End)
+    // Test the condition again for the next iteration.
+    CondV = Cond->codegenCond();
+    if (!CondV)
         return nullptr;
+    Builder->CreateCondBr(CondV, LoopBB, AfterBB);
 
-    // The step value is optional.
-    std::unique_ptr<ExprAST> Step;
-    if (CurTok == ',')
-    {
-        getNextToken();
-        Step = ParseExpression();
-        if (!Step)
-            return nullptr;
-    }
-
-    if (CurTok != tok_in)
-        return LogError("expected 'in' after for");
-    getNextToken(); // eat 'in'.
-
-    auto Body = ParseExpression();
-    if (!Body)
-        return nullptr;
+    TheFunction->insert(TheFunction->end(), AfterBB);
+    Builder->SetInsertPoint(AfterBB);
 
-    return std::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End), std::move(Step), std::move(Body));
+    // while expr always returns 0.0.
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr()
+/// emitChunk - Outline the body into "void parent.par(env, lo, hi)", which
+/// runs iterations lo to hi - 1 with the enclosing function's variables
+/// copied out of env.  Since every iteration sees the same variables, the
+/// body must not assign to them or to globals; reductions have their own
+/// expressions.  Returns null on error.
+Function *ParallelForExprAST::emitChunk(StructType *EnvTy,
+                                        const std::vector<std::pair<std::string, AllocaInst *>> &Captures)
 {
-    getNextToken(); // eat the var.
+    Function *Parent = Builder->GetInsertBlock()->getParent();
+    Type *Int64Ty = Builder->getInt64Ty();
+    FunctionType *ChunkTy =
+        FunctionType::get(Builder->getVoidTy(), {PointerType::getUnqual(*TheContext), Int64Ty, Int64Ty}, false);
+    Function *Chunk = Function::Create(ChunkTy, Function::InternalLinkage, Parent->getName() + ".par", TheModule.get());
+    Chunk->setDoesNotThrow();
+    Argument *Env = Chunk->getArg(0), *Lo = Chunk->getArg(1), *Hi = Chunk->getArg(2);
+    Env->setName("env");
+    Lo->setName("lo");
+    Hi->setName("hi");
+    ParallelChunks.push_back(Chunk);
+
+    // The chunk is emitted in the middle of its parent, so everything that
+    // describes the code being emitted is set aside until it is done.
+    IRBuilderBase::InsertPointGuard Guard(*Builder);
+    auto OuterNamedValues = std::move(NamedValues);
+    auto OuterCountedLoops = std::move(CountedLoops);
+    auto OuterLoopExits = std::move(LoopExits);
+    NamedValues.clear();
+    CountedLoops.clear();
+    LoopExits.clear();
 
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Chunk));
+    std::map<AllocaInst *, std::string> Shared;
+    for (unsigned i = 0, e = Captures.size(); i != e; ++i)
+    {
+        auto &[Name, Outer] = Captures[i];
+        AllocaInst *A = CreateEntryBlockAlloca(Chunk, Name, Outer->getAllocatedType());
+        Builder->CreateStore(
+            Builder->CreateLoad(Outer->getAllocatedType(), Builder->CreateStructGEP(EnvTy, Env, i), Name), A);
+        NamedValues[Name] = A;
+        Shared[A] = Name;
+    }
+    AllocaInst *VarA = CreateEntryBlockAlloca(Chunk, VarName, Int64Ty);
+    NamedValues[VarName] = VarA;
 
-    // At least one variable name is required.
-    if (CurTok != tok_identifier)
-        return LogError("expected identifier after var");
+    // Each chunk is a counted loop over its slice of the range.
+    CountedLoop Counted(VarA, Lo);
+    Counted.Bound = Builder->CreateSub(Hi, Builder->getInt64(1), "last");
+    BasicBlock *EntryBB = Builder->GetInsertBlock();
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", Chunk);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop");
+    Counted.Entry = Builder->CreateCondBr(Builder->CreateICmpSLT(Lo, Hi, "nonempty"), LoopBB, AfterBB);
 
-    while (true)
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *Var = Builder->CreatePHI(Int64Ty, 2, VarName);
+    Var->addIncoming(Lo, EntryBB);
+    StoreInst *CounterCopy = Builder->CreateStore(Var, VarA);
+
+    CountedLoops.push_back(&Counted);
+    LoopExits.push_back(nullptr);
+    bool Ok = Body->codegen();
+    if (Ok)
     {
-        std::string Name = IdentifierStr;
-        getNextToken(); // eat identifier.
-
-        // Read the optional initializer.
-        std::unique_ptr<ExprAST> Init = nullptr;
-        if (CurTok == '=')
-        {
-            getNextToken(); // eat the '='.
+        Value *StepVal = Builder->getInt64(1);
+        Counted.finish(LoopBB, StepVal, CounterCopy);
+        Value *NextVar = Builder->CreateNSWAdd(Var, StepVal, "nextvar");
+        Var->addIncoming(NextVar, Builder->GetInsertBlock());
+        Builder->CreateCondBr(Builder->CreateICmpSLT(NextVar, Hi, "more"), LoopBB, AfterBB);
+        Chunk->insert(Chunk->end(), AfterBB);
+        Builder->SetInsertPoint(AfterBB);
+        Builder->CreateRetVoid();
+    }
+    else
+        delete AfterBB;
 
-            Init = ParseExpression();
-            if (!Init)
-                return nullptr;
-        }
+    NamedValues = std::move(OuterNamedValues);
+    CountedLoops = std::move(OuterCountedLoops);
+    LoopExits = std::move(OuterLoopExits);
+    if (!Ok)
+        return nullptr;
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    // Only the copies made on entry may store to the shared variables.
+    for (auto &BB : *Chunk)
+        for (auto &I : BB)
+            if (auto *SI = dyn_cast<StoreInst>(&I); SI && SI->getParent() != &Chunk->getEntryBlock())
+            {
+                Value *Ptr = SI->getPointerOperand();
+                if (auto It = Shared.find(dyn_cast<AllocaInst>(Ptr)); It != Shared.end())
+                {
+                    std::string Msg = "parallel for body assigns to '" + It->second +
+                                      "', which all its iterations share; use a reduction instead";
+                    return static_cast<Function *>(LogErrorV(Msg.c_str()));
+                }
+                if (isa<GlobalVariable>(Ptr))
+                    return static_cast<Function *>(LogErrorV("parallel for body assigns to a global"));
+            }
+    return Chunk;
+}
 
-        // End of var list, exit loop.
-        if (CurTok != ',')
-            break;
-        getNextToken(); // eat the ','.
+Value *ParallelForExprAST::codegen()
+{
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    Value *StartVal = Start->codegen();
+    if (!StartVal || !(StartVal = convertTo(StartVal, VarType)))
+        return nullptr;
+    Value *EndVal = End->codegen();
+    if (!EndVal || !(EndVal = convertTo(EndVal, VarType)))
+        return nullptr;
 
-        if (CurTok != tok_identifier)
-            return LogError("expected identifier list after var");
+    // Every variable in scope is passed to the chunks by value.
+    std::vector<std::pair<std::string, AllocaInst *>> Captures;
+    std::vector<Type *> EnvTypes;
+    for (auto &[Name, A] : NamedValues)
+        if (A)
+        {
+            Captures.emplace_back(Name, A);
+            EnvTypes.push_back(A->getAllocatedType());
+        }
+    StructType *EnvTy = StructType::get(*TheContext, EnvTypes);
+    AllocaInst *Env = CreateEntryBlockAlloca(TheFunction, "env", EnvTy);
+    for (unsigned i = 0, e = Captures.size(); i != e; ++i)
+    {
+        auto &[Name, A] = Captures[i];
+        Builder->CreateStore(Builder->CreateLoad(A->getAllocatedType(), A, Name),
+                             Builder->CreateStructGEP(EnvTy, Env, i));
     }
 
-    // At this point, we have to have 'in'.
-    if (CurTok != tok_in)
-        return LogError("expected 'in' keyword after 'var'");
-    getNextToken(); // eat 'in'.
-
-    auto Body = ParseExpression();
-    if (!Body)
+    Function *Chunk = emitChunk(EnvTy, Captures);
+    if (!Chunk)
         return nullptr;
 
-    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    Type *PtrTy = PointerType::getUnqual(*TheContext);
+    Type *Int64Ty = Builder->getInt64Ty();
+    Function *ParallelFor = getRuntimeFunction(
+        "kal_parallel_for", FunctionType::get(Builder->getVoidTy(), {PtrTy, PtrTy, Int64Ty, Int64Ty}, false));
+    Builder->CreateCall(ParallelFor, {Chunk, Env, StartVal, EndVal});
+    ++NumParallelLoops;
+
+    // parallel for expr always returns 0.0.
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
 }
 
-/// primary
-///   ::= identifierexpr
-///   ::= numberexpr
-///   ::= parenexpr
-///   ::= ifexpr
-///   ::= forexpr
-///   ::= varexpr
-static std::unique_ptr<ExprAST> ParsePrimary()
+/// getIdentity - The result of reducing an empty range.
+Value *RangeReduceExprAST::getIdentity() const
 {
-    switch (CurTok)
+    bool FP = Ty == ValueType::Double;
+    switch (Reduction)
     {
-    default:
-        return LogError("unknown token when expecting an expression");
-    case tok_identifier:
-        return ParseIdentifierExpr();
-    case tok_number:
-        return ParseNumberExpr();
-    case '(':
-        return ParseParenExpr();
-    case tok_if:
-        return ParseIfExpr();
-    case tok_for:
-        return ParseForExpr();
-    case tok_var:
-        return ParseVarExpr();
+    case RK_Sum:
+        return FP ? ConstantFP::get(Builder->getDoubleTy(), 0.0) : Builder->getInt64(0);
+    case RK_Prod:
+        return FP ? ConstantFP::get(Builder->getDoubleTy(), 1.0) : Builder->getInt64(1);
+    case RK_Min:
+        return FP ? ConstantFP::getInfinity(Builder->getDoubleTy()) : Builder->getInt64(INT64_MAX);
+    case RK_Max:
+        return FP ? ConstantFP::getInfinity(Builder->getDoubleTy(), /*Negative=*/true)
+                  : Builder->getInt64(INT64_MIN);
     }
+    llvm_unreachable("unknown reduction");
 }
 
-/// unary
-///   ::= primary
-///   ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary()
+/// combine - Fold V into the accumulator.  Only this operation may be
+/// reassociated, which is what lets the vectorizer keep a partial result per
+/// lane; the body's own arithmetic stays strictly ordered.  NaNs have no
+/// defined place in a min or max.
+Value *RangeReduceExprAST::combine(Value *Acc, Value *V) const
 {
-    // If the current token is not an operator, it must be a primary expr.
-    if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
-        return ParsePrimary();
+    IRBuilderBase::FastMathFlagGuard Guard(*Builder);
+    FastMathFlags FMF;
+    FMF.setAllowReassoc();
+    if (Reduction == RK_Min || Reduction == RK_Max)
+    {
+        FMF.setNoNaNs();
+        FMF.setNoSignedZeros();
+    }
+    Builder->setFastMathFlags(FMF);
 
-    // If this is a unary operator, read it.
-    int Opc = CurTok;
-    getNextToken();
-    if (auto Operand = ParseUnary())
-        return std::make_unique<UnaryExprAST>(Opc, std::move(Operand));
-    return nullptr;
+    bool FP = Ty == ValueType::Double;
+    switch (Reduction)
+    {
+    case RK_Sum:
+        return FP ? Builder->CreateFAdd(Acc, V, "acc.next") : Builder->CreateAdd(Acc, V, "acc.next");
+    case RK_Prod:
+        return FP ? Builder->CreateFMul(Acc, V, "acc.next") : Builder->CreateMul(Acc, V, "acc.next");
+    case RK_Min:
+        return FP ? Builder->CreateMinNum(Acc, V, "acc.next")
+                  : Builder->CreateBinaryIntrinsic(Intrinsic::smin, Acc, V, nullptr, "acc.next");
+    case RK_Max:
+        return FP ? Builder->CreateMaxNum(Acc, V, "acc.next")
+                  : Builder->CreateBinaryIntrinsic(Intrinsic::smax, Acc, V, nullptr, "acc.next");
+    }
+    llvm_unreachable("unknown reduction");
 }
 
-/// binoprhs
-///   ::= ('+' unary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS)
+Value *RangeReduceExprAST::codegen()
 {
-    // If this is a binop, find its precedence.
-    while (true)
-    {
-        int TokPrec = GetTokPrecedence();
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    if (!isScalar(VarType))
+        return LogErrorV("reduction variable must be a number");
+    if (!isScalar(Ty))
+        return LogErrorV("only numbers can be reduced");
+    Type *VarTy = getLLVMType(VarType);
+    Type *AccTy = getLLVMType(Ty);
+
+    // Both bounds are evaluated once, without the variable in scope.
+    Value *StartVal = Start->codegen();
+    if (!StartVal || !(StartVal = convertTo(StartVal, VarType)))
+        return nullptr;
+    Value *EndVal = End->codegen();
+    if (!EndVal || !(EndVal = convertTo(EndVal, VarType)))
+        return nullptr;
 
-        // If this is a binop that binds at least as tightly as the current binop,
-        // consume it, otherwise we are done.
-        if (TokPrec < ExprPrec)
-            return LHS;
+    // The counter is a register.  The body sees a copy of it in an alloca,
+    // so assigning to the variable can't change how often the loop runs.
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+    AllocaInst *OldVal = NamedValues[VarName];
+    NamedValues[VarName] = Alloca;
 
-        // Okay, we know this is a binop.
-        int BinOp = CurTok;
-        getNextToken(); // eat binop
+    // The body runs with i = Start, ..., End - 1, which is a counted loop up
+    // to End - 1 as far as hoisting bounds checks is concerned.
+    CountedLoop Counted(Alloca, StartVal);
+    if (VarType == ValueType::Int)
+        Counted.Bound = Builder->CreateSub(EndVal, Builder->getInt64(1), "last");
 
-        // Parse the unary expression after the binary operator.
-        auto RHS = ParseUnary();
-        if (!RHS)
-            return nullptr;
+    Value *NonEmpty = VarType == ValueType::Double ? Builder->CreateFCmpOLT(StartVal, EndVal, "nonempty")
+                                                   : Builder->CreateICmpSLT(StartVal, EndVal, "nonempty");
+    BasicBlock *PreheaderBB = Builder->GetInsertBlock();
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "reduce", TheFunction);
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterreduce");
+    Counted.Entry = Builder->CreateCondBr(NonEmpty, LoopBB, AfterBB);
 
-        // If BinOp binds less tightly with RHS than the operator after RHS, let
-        // the pending operator take RHS as its LHS.
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec)
-        {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
-        }
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *Var = Builder->CreatePHI(VarTy, 2, VarName);
+    PHINode *Acc = Builder->CreatePHI(AccTy, 2, "acc");
+    Var->addIncoming(StartVal, PreheaderBB);
+    Acc->addIncoming(getIdentity(), PreheaderBB);
+    StoreInst *CounterCopy = Builder->CreateStore(Var, Alloca);
+
+    CountedLoops.push_back(&Counted);
+    LoopExits.push_back(nullptr);
+    Value *V = Body->codegen();
+    if (!V || !(V = convertTo(V, Ty)))
+        return nullptr;
+    LoopExits.pop_back();
+    CountedLoops.pop_back();
+
+    Value *StepVal = VarType == ValueType::Double ? ConstantFP::get(VarTy, 1.0) : ConstantInt::get(VarTy, 1);
+    Counted.finish(LoopBB, StepVal, CounterCopy);
+
+    Value *Next = combine(Acc, V);
+    Value *NextVar = VarType == ValueType::Double ? Builder->CreateFAdd(Var, StepVal, "nextvar")
+                                                  : Builder->CreateNSWAdd(Var, StepVal, "nextvar");
+    Value *More = VarType == ValueType::Double ? Builder->CreateFCmpOLT(NextVar, EndVal, "more")
+                                               : Builder->CreateICmpSLT(NextVar, EndVal, "more");
+    BasicBlock *LoopEndBB = Builder->GetInsertBlock();
+    Var->addIncoming(NextVar, LoopEndBB);
+    Acc->addIncoming(Next, LoopEndBB);
+    Builder->CreateCondBr(More, LoopBB, AfterBB);
+
+    TheFunction->insert(TheFunction->end(), AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+    PHINode *Result = Builder->CreatePHI(AccTy, 2, "reduced");
+    Result->addIncoming(getIdentity(), PreheaderBB);
+    Result->addIncoming(Next, LoopEndBB);
 
-        // Merge LHS/RHS.
-        LHS = std::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
-    }
+    // Restore the unshadowed variable.
+    if (OldVal)
+        NamedValues[VarName] = OldVal;
+    else
+        NamedValues.erase(VarName);
+
+    return Result;
 }
 
-/// expression
-///   ::= unary binoprhs
-///
-static std::unique_ptr<ExprAST> ParseExpression()
+/// startDeadBlock - After break or return has terminated the current block,
+/// continue in a new one that nothing branches to, for the rest of the
+/// enclosing expression.  It is deleted before optimization.  Returns the
+/// value the break or return stands for, which no reachable code can use.
+static Value *startDeadBlock(const char *Name)
 {
-    auto LHS = ParseUnary();
-    if (!LHS)
-        return nullptr;
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, Name, TheFunction));
+    return ConstantInt::getFalse(*TheContext);
+}
 
-    return ParseBinOpRHS(0, std::move(LHS));
+Value *BreakExprAST::codegen()
+{
+    if (LoopExits.empty())
+        return LogErrorV("break outside of a loop");
+    if (!LoopExits.back())
+        return LogErrorV("cannot break out of a reduction or parallel loop");
+    Builder->CreateBr(LoopExits.back());
+    return startDeadBlock("afterbreak");
 }
 
-/// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
-static std::unique_ptr<PrototypeAST> ParsePrototype()
+// The operand of a return is in tail position wherever the return is, so
+// "return f(x)" is a tail call even from inside a loop.
+Value *ReturnExprAST::codegen()
 {
-    std::string FnName;
+    if (is_contained(ParallelChunks, Builder->GetInsertBlock()->getParent()))
+        return LogErrorV("cannot return from inside a parallel loop");
+    if (!Val->codegenReturn())
+        return nullptr;
+    return startDeadBlock("afterreturn");
+}
 
-    unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
-    unsigned BinaryPrecedence = 30;
+bool ReturnExprAST::codegenReturn()
+{
+    return Val->codegenReturn();
+}
 
-    switch (CurTok)
+/// pushBindings - Emit the initializers and bring the variables into scope,
+/// saving the bindings they shadow in OldBindings.
+bool VarExprAST::pushBindings(std::vector<AllocaInst *> &OldBindings)
+{
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // Register all variables and emit their initializer.
+    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
     {
-    default:
-        return LogErrorP("Expected function name in prototype");
-    case tok_identifier:
-        FnName = IdentifierStr;
-        Kind = 0;
-        getNextToken();
-        break;
-    case tok_unary:
-        getNextToken();
-        if (!isascii(CurTok))
-            return LogErrorP("Expected unary operator");
-        FnName = "unary";
-        FnName += (char)CurTok;
-        Kind = 1;
-        getNextToken();
-        break;
-    case tok_binary:
-        getNextToken();
-        if (!isascii(CurTok))
-            return LogErrorP("Expected binary operator");
-        FnName = "binary";
-        FnName += (char)CurTok;
-        Kind = 2;
-        getNextToken();
+        const std::string &VarName = VarNames[i].first;
+        ExprAST *Init = VarNames[i].second.get();
 
-        // Read the precedence if present.
-        if (CurTok == tok_number)
+        // Emit the initializer before adding the variable to scope, this prevents
+        // the initializer from referencing the variable itself, and permits stuff
+        // like this:
+        //  var a = 1 in
+        //    var a = a in ...   # refers to outer 'a'.
+        Value *InitVal;
+        if (Init)
         {
-            if (NumVal < 1 || NumVal > 100)
-                return LogErrorP("Invalid precedence: must be 1..100");
-            BinaryPrecedence = (unsigned)NumVal;
-            getNextToken();
+            InitVal = Init->codegen();
+            if (!InitVal || !(InitVal = convertTo(InitVal, VarTypes[i])))
+                return false;
         }
-        break;
+        else
+        { // If not specified, use zero.
+            InitVal = Constant::getNullValue(getLLVMType(VarTypes[i]));
+        }
+
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, getLLVMType(VarTypes[i]));
+        Builder->CreateStore(InitVal, Alloca);
+
+        // Remember the old variable binding so that we can restore the binding when
+        // we unrecurse.
+        OldBindings.push_back(NamedValues[VarName]);
+
+        // Remember this binding.
+        NamedValues[VarName] = Alloca;
     }
+    return true;
+}
 
-    if (CurTok != '(')
-        return LogErrorP("Expected '(' in prototype");
+/// popBindings - Pop all our variables from scope.
+void VarExprAST::popBindings(const std::vector<AllocaInst *> &OldBindings)
+{
+    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
+        NamedValues[VarNames[i].first] = OldBindings[i];
+}
 
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
-    if (CurTok != ')')
-        return LogErrorP("Expected ')' in prototype");
+Value *VarExprAST::codegen()
+{
+    std::vector<AllocaInst *> OldBindings;
+    if (!pushBindings(OldBindings))
+        return nullptr;
 
-    // success.
-    getNextToken(); // eat ')'.
+    // Codegen the body, now that all vars are in scope.
+    Value *BodyVal = Body->codegen();
+    if (!BodyVal)
+        return nullptr;
 
-    // Verify right number of names for operator.
-    if (Kind && ArgNames.size() != Kind)
-        return LogErrorP("Invalid number of operands for operator");
+    popBindings(OldBindings);
 
-    return std::make_unique<PrototypeAST>(FnName, ArgNames, Kind != 0, BinaryPrecedence);
+    // Return the body computation.
+    return BodyVal;
 }
 
-/// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition()
+bool VarExprAST::codegenReturn()
 {
-    getNextToken(); // eat def.
-    auto Proto = ParsePrototype();
-    if (!Proto)
-        return nullptr;
+    std::vector<AllocaInst *> OldBindings;
+    if (!pushBindings(OldBindings))
+        return false;
 
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    return nullptr;
+    // The body is in tail position too.
+    if (!Body->codegenReturn())
+        return false;
+
+    popBindings(OldBindings);
+    return true;
 }
 
-/// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
+Function *PrototypeAST::codegen()
 {
-    if (auto E = ParseExpression())
+    // Make the function type:  double(double,int) etc.
+    std::vector<Type *> ParamTypes;
+    for (ValueType T : ArgTypes)
+        ParamTypes.push_back(getLLVMType(T));
+    FunctionType *FT = FunctionType::get(getLLVMType(RetType), ParamTypes, false);
+
+    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+
+    // Set names for all arguments.
+    unsigned Idx = 0;
+    for (auto &Arg : F->args())
+        Arg.setName(Args[Idx++]);
+
+    // Attach whatever we know about the function's side effects.  Every module
+    // re-declares its callees through here, so the attributes follow the
+    // function across module boundaries.
+    if (Effects)
     {
-        // Make an anonymous proto.
-        auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        // A memo cache leaves a function pure to its callers, but the optimizer
+        // still has to know that calls update it.
+        if (Effects->isPure() && Effects->InaccessibleMemory)
+            F->setOnlyAccessesInaccessibleMemory();
+        else if (Effects->isPure())
+            F->setDoesNotAccessMemory();
+        else if (!Effects->WritesMemory && !Effects->InaccessibleMemory)
+            F->setOnlyReadsMemory();
+        if (!Effects->MayUnwind)
+            F->setDoesNotThrow();
+        if (!Effects->MayNotReturn)
+            F->setWillReturn();
+        if (!Effects->MayRecurse)
+            F->setDoesNotRecurse();
     }
-    return nullptr;
-}
 
-/// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern()
-{
-    getNextToken(); // eat extern.
-    return ParsePrototype();
+    return F;
 }
 
-//===----------------------------------------------------------------------===//
-// Code Generation
-//===----------------------------------------------------------------------===//
+static ValueType inferLocalTypes(const PrototypeAST &P, ExprAST &Body, bool IntLiterals = false);
+static void InitializeModule();
 
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, AllocaInst *> NamedValues;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
-static std::unique_ptr<FunctionPassManager> TheFPM;
-static std::unique_ptr<LoopAnalysisManager> TheLAM;
-static std::unique_ptr<FunctionAnalysisManager> TheFAM;
-static std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-static std::unique_ptr<ModuleAnalysisManager> TheMAM;
-static std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-static std::unique_ptr<StandardInstrumentations> TheSI;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-static ExitOnError ExitOnErr;
+/// toBits - The 64-bit pattern of scalar V, as a memo cache stores it.
+static Value *toBits(Value *V)
+{
+    switch (getValueType(V->getType()))
+    {
+    case ValueType::Bool:
+        return Builder->CreateZExt(V, Builder->getInt64Ty());
+    case ValueType::Double:
+        return Builder->CreateBitCast(V, Builder->getInt64Ty());
+    default:
+        return V;
+    }
+}
 
-Value *LogErrorV(const char *Str)
+/// fromBits - The scalar of type Ty whose pattern toBits gives as Bits.
+static Value *fromBits(Value *Bits, ValueType Ty)
 {
-    LogError(Str);
-    return nullptr;
+    switch (Ty)
+    {
+    case ValueType::Bool:
+        return Builder->CreateTrunc(Bits, Builder->getInt1Ty());
+    case ValueType::Double:
+        return Builder->CreateBitCast(Bits, Builder->getDoubleTy());
+    default:
+        return Bits;
+    }
 }
 
-Function *getFunction(std::string Name)
+/// emitMemoLookup - Emit the body of memo function F: look the arguments up
+/// in a new cache, and on a miss call Body and remember what it returns.
+static void emitMemoLookup(Function &F, Function &Body, const PrototypeAST &P)
 {
-    // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(Name))
-        return F;
+    MemoCaches.push_back(std::make_unique<MemoCache>(P.getName(), F.arg_size(), MemoCacheSize));
+    MemoCache *Cache = MemoCaches.back().get();
 
-    // If not, check whether we can codegen the declaration from some existing
-    // prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", &F));
+    Type *I64 = Builder->getInt64Ty(), *Ptr = PointerType::getUnqual(*TheContext);
+    Value *CacheV = ConstantExpr::getIntToPtr(Builder->getInt64(reinterpret_cast<uintptr_t>(Cache)), Ptr);
 
-    // If no existing prototype exists, return null.
-    return nullptr;
+    ArrayType *KeyTy = ArrayType::get(I64, F.arg_size());
+    Value *Key = Builder->CreateAlloca(KeyTy, nullptr, "key");
+    std::vector<Value *> Args;
+    for (auto &Arg : F.args())
+    {
+        Builder->CreateStore(toBits(&Arg), Builder->CreateConstInBoundsGEP2_64(KeyTy, Key, 0, Arg.getArgNo()));
+        Args.push_back(&Arg);
+    }
+    Value *Result = Builder->CreateAlloca(I64, nullptr, "result");
+
+    Function *Lookup =
+        getRuntimeFunction("kal_memo_lookup", FunctionType::get(Builder->getInt1Ty(), {Ptr, Ptr, Ptr}, false));
+    Lookup->setOnlyAccessesInaccessibleMemOrArgMem();
+    Lookup->setWillReturn();
+    Function *Store =
+        getRuntimeFunction("kal_memo_store", FunctionType::get(Builder->getVoidTy(), {Ptr, Ptr, I64}, false));
+    Store->setOnlyAccessesInaccessibleMemOrArgMem();
+    Store->setWillReturn();
+
+    BasicBlock *HitBB = BasicBlock::Create(*TheContext, "hit", &F);
+    BasicBlock *MissBB = BasicBlock::Create(*TheContext, "miss", &F);
+    Builder->CreateCondBr(Builder->CreateCall(Lookup, {CacheV, Key, Result}, "cached"), HitBB, MissBB);
+
+    Builder->SetInsertPoint(HitBB);
+    Builder->CreateRet(fromBits(Builder->CreateLoad(I64, Result, "bits"), P.getReturnType()));
+
+    Builder->SetInsertPoint(MissBB);
+    Value *V = Builder->CreateCall(&Body, Args, "calltmp");
+    Builder->CreateCall(Store, {CacheV, Key, toBits(V)});
+    Builder->CreateRet(V);
 }
 
-/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
-/// the function.  This is used for mutable variables etc.
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName)
+/// MultiVersionTarget - A CPU a multiversion function gets a version for, and
+/// the features that version is compiled with, spelled out in full as
+/// kal_cpu_level checks them rather than left to the CPU name.
+struct MultiVersionTarget
 {
-    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, VarName);
-}
+    const char *CPU;
+    const char *Features;
+};
 
-Value *NumberExprAST::codegen()
+/// getMultiVersionTargets - The targets a multiversion function gets a
+/// version for, from the baseline up.  kal_cpu_level picks among them by
+/// index.  Targets without a list compile multiversion functions like any
+/// other.
+static ArrayRef<MultiVersionTarget> getMultiVersionTargets()
 {
-    return ConstantFP::get(*TheContext, APFloat(Val));
+#if defined(__x86_64__) || defined(_M_X64)
+    static const MultiVersionTarget Targets[] = {
+        {"x86-64", "+64bit,+cmov,+cx8,+fxsr,+mmx,+sse,+sse2,+x87"},
+        {"x86-64-v2", "+64bit,+cmov,+cx8,+fxsr,+mmx,+sse,+sse2,+x87,+cx16,+popcnt,+sahf,+sse3,+sse4.1,+sse4.2,+ssse3"},
+        {"x86-64-v3", "+64bit,+cmov,+cx8,+fxsr,+mmx,+sse,+sse2,+x87,+cx16,+popcnt,+sahf,+sse3,+sse4.1,+sse4.2,+ssse3,"
+                      "+avx,+avx2,+bmi,+bmi2,+f16c,+fma,+lzcnt,+movbe,+xsave"},
+        {"x86-64-v4", "+64bit,+cmov,+cx8,+fxsr,+mmx,+sse,+sse2,+x87,+cx16,+popcnt,+sahf,+sse3,+sse4.1,+sse4.2,+ssse3,"
+                      "+avx,+avx2,+bmi,+bmi2,+f16c,+fma,+lzcnt,+movbe,+xsave,"
+                      "+avx512bw,+avx512cd,+avx512dq,+avx512f,+avx512vl"},
+    };
+    return Targets;
+#else
+    return {};
+#endif
 }
 
-Value *VariableExprAST::codegen()
+/// passesWideVectors - Whether FT takes or returns vectors wider than 128 bits.
+/// Those are passed in registers as wide as the target features allow, so
+/// versions compiled for different levels can't call each other with them.
+static bool passesWideVectors(FunctionType *FT)
 {
-    // Look this variable up in the function.
-    AllocaInst *A = NamedValues[Name];
-    if (!A)
-        return LogErrorV("Unknown variable name");
+    auto IsWide = [](Type *T) { return T->isVectorTy() && T->getPrimitiveSizeInBits() > 128; };
+    return IsWide(FT->getReturnType()) || any_of(FT->params(), IsWide);
+}
 
-    // Load the value.
-    return Builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+/// checkMultiVersionCalls - A multiversion function is called with the JIT's
+/// features and its versions call others with their own, so neither its
+/// signature nor the calls it makes may pass wide vectors.  Returns false,
+/// after reporting an error, if F does.
+static bool checkMultiVersionCalls(Function &F)
+{
+    bool Wide = passesWideVectors(F.getFunctionType());
+    for (auto &BB : F)
+        for (auto &I : BB)
+            if (auto *CI = dyn_cast<CallInst>(&I); CI && !isa<IntrinsicInst>(CI))
+                Wide |= passesWideVectors(CI->getFunctionType());
+    if (Wide)
+        LogError("multiversion functions can't pass vectors wider than vec2");
+    return !Wide;
 }
 
-Value *UnaryExprAST::codegen()
+/// emitMultiVersions - Move the body of F into an internal copy for each of
+/// getMultiVersionTargets, and make F a stub that asks the runtime for the
+/// best level this machine supports and tail-calls that copy out of a
+/// constant table.  The choice is made where the code runs, so a cached
+/// object stays fast on every machine it is loaded on.  Returns the copies,
+/// or nothing if there is one target.
+static std::vector<Function *> emitMultiVersions(Function &F)
 {
-    Value *OperandV = Operand->codegen();
-    if (!OperandV)
-        return nullptr;
+    ArrayRef<MultiVersionTarget> Targets = getMultiVersionTargets();
+    std::vector<Function *> Versions;
+    if (Targets.empty())
+        return Versions;
 
-    Function *F = getFunction(std::string("unary") + Opcode);
-    if (!F)
-        return LogErrorV("Unknown unary operator");
+    std::vector<Constant *> Table;
+    for (const MultiVersionTarget &T : Targets)
+    {
+        ValueToValueMapTy VMap;
+        Function *V = CloneFunction(&F, VMap);
+        V->setName(F.getName() + "." + T.CPU);
+        V->setLinkage(GlobalValue::InternalLinkage);
+        V->addFnAttr("target-cpu", T.CPU);
+        V->addFnAttr("target-features", T.Features);
+
+        // Recursion stays within the version.
+        for (auto &BB : *V)
+            for (auto &I : BB)
+                if (auto *CI = dyn_cast<CallInst>(&I); CI && CI->getCalledFunction() == &F)
+                    CI->setCalledFunction(V);
+        Versions.push_back(V);
+        Table.push_back(V);
+    }
 
-    return Builder->CreateCall(F, OperandV, "unop");
+    GlobalValue::LinkageTypes Linkage = F.getLinkage();
+    F.deleteBody();
+    F.setLinkage(Linkage);
+
+    Type *Ptr = PointerType::getUnqual(*TheContext);
+    ArrayType *TableTy = ArrayType::get(Ptr, Table.size());
+    auto *TableV = new GlobalVariable(*TheModule, TableTy, true, GlobalValue::InternalLinkage,
+                                      ConstantArray::get(TableTy, Table), F.getName() + ".versions");
+
+    // The level is worked out once, in the runtime's own memory, and reading
+    // the constant table doesn't touch any memory the module can change.
+    Function *Level = getRuntimeFunction("kal_cpu_level", FunctionType::get(Builder->getInt64Ty(), false));
+    Level->setDoesNotAccessMemory();
+    Level->setWillReturn();
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", &F));
+    Value *Idx = Builder->CreateBinaryIntrinsic(Intrinsic::umin, Builder->CreateCall(Level, {}, "level"),
+                                               Builder->getInt64(Table.size() - 1));
+    LoadInst *Chosen = Builder->CreateAlignedLoad(
+        Ptr, Builder->CreateInBoundsGEP(TableTy, TableV, {Builder->getInt64(0), Idx}),
+        TheModule->getDataLayout().getPointerABIAlignment(0), "version");
+    Chosen->setMetadata(LLVMContext::MD_invariant_load, MDNode::get(*TheContext, {}));
+
+    std::vector<Value *> Args;
+    for (auto &Arg : F.args())
+        Args.push_back(&Arg);
+    CallInst *Call = Builder->CreateCall(F.getFunctionType(), Chosen, Args);
+    Call->setTailCallKind(CallInst::TCK_MustTail);
+    Builder->CreateRet(Call);
+
+    ++NumMultiVersioned;
+    return Versions;
 }
 
-Value *BinaryExprAST::codegen()
+static cl::opt<bool> LazyJIT("lazy", cl::desc("Optimize and compile each function on its first call, without "
+                                             "inlining or specializing across definitions"),
+                             cl::init(false));
+static cl::opt<bool> TieredJIT("tiered", cl::desc("Compile each function quickly at first, and again at -O3 once it "
+                                                  "gets hot, without inlining or specializing across definitions"),
+                               cl::init(false));
+static cl::opt<uint64_t> TierUpThreshold("tier-up-threshold",
+                                         cl::desc("Calls plus loop iterations after which a function gets recompiled"),
+                                         cl::init(10000));
+
+/// optimizesInJIT - Whether the JIT optimizes each function itself, rather
+/// than the front end optimizing it as soon as it's defined.
+static bool optimizesInJIT()
 {
-    // Special case '=' because we don't want to emit the LHS as an expression.
-    if (Op == '=')
+    return LazyJIT || TieredJIT;
+}
+
+Function *FunctionAST::codegen()
+{
+    // Defining a function again swaps the body behind its stub, so callers
+    // compiled against the old prototype must be able to call the new one.
+    std::string Name = Proto->getName();
+    std::unique_ptr<PrototypeAST> OldProto;
+    if (DefinedFunctions.count(Name))
     {
-        // Assignment requires the LHS to be an identifier.
-        // This assume we're building without RTTI because LLVM builds that way by
-        // default.  If you build LLVM with RTTI this can be changed to a
-        // dynamic_cast for automatic error checking.
-        VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
-        if (!LHSE)
-            return LogErrorV("destination of '=' must be a variable");
-        // Codegen the RHS.
-        Value *Val = RHS->codegen();
-        if (!Val)
+        OldProto = std::move(FunctionProtos[Name]);
+        if (OldProto->getArgTypes() != Proto->getArgTypes() || OldProto->getReturnType() != Proto->getReturnType())
+        {
+            FunctionProtos[Name] = std::move(OldProto);
+            LogError("a redefinition must keep the argument and return types");
             return nullptr;
-
-        // Look up the name.
-        Value *Variable = NamedValues[LHSE->getName()];
-        if (!Variable)
-            return LogErrorV("Unknown variable name");
-
-        Builder->CreateStore(Val, Variable);
-        return Val;
+        }
     }
 
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if (!L || !R)
+    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
+    // reference to it for use below.  A failed redefinition puts the old one
+    // back.
+    auto &P = *Proto;
+    FunctionProtos[Name] = std::move(Proto);
+    auto Fail = [&]() -> Function * {
+        if (OldProto)
+            FunctionProtos[Name] = std::move(OldProto);
         return nullptr;
+    };
 
-    switch (Op)
+    // With the prototype registered, recursive calls know their return type.
+    inferLocalTypes(P, *Body);
+
+    // Infer the body's side effects, which can depend on the types just
+    // inferred, before the function is declared, so that its own declaration
+    // and every later one carry matching attributes.
+    FunctionEffects FE;
+    Body->collectEffects(P.getName(), FE);
+
+    // Answering a memo function's calls from its cache is only invisible if
+    // the body has no side effects and the results fit in a cache entry.
+    if (P.isMemo())
     {
-    case '+':
-        return Builder->CreateFAdd(L, R, "addtmp");
-    case '-':
-        return Builder->CreateFSub(L, R, "subtmp");
-    case '*':
-        return Builder->CreateFMul(L, R, "multmp");
-    case '<':
-        L = Builder->CreateFCmpULT(L, R, "cmptmp");
-        // Convert bool 0/1 to double 0.0 or 1.0
-        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-    default:
-        break;
+        if (!FE.isPure())
+        {
+            LogError("memo functions must not have side effects");
+            return Fail();
+        }
+        if (!isScalar(P.getReturnType()) || !std::all_of(P.getArgTypes().begin(), P.getArgTypes().end(), isScalar))
+        {
+            LogError("memo functions must take and return numbers");
+            return Fail();
+        }
+        FE.InaccessibleMemory = true;
     }
 
-    // If it wasn't a builtin binary operator, it must be a user defined one. Emit
-    // a call to it.
-    Function *F = getFunction(std::string("binary") + Op);
-    assert(F && "binary operator not found!");
-
-    Value *Ops[] = {L, R};
-    return Builder->CreateCall(F, Ops, "binop");
-}
+    // A multiversion function asks the runtime which version to run, which
+    // its callers can't observe either.
+    if (P.isMultiVersion())
+        FE.InaccessibleMemory = true;
 
-Value *CallExprAST::codegen()
-{
-    // Look up the name in the global module table.
-    Function *CalleeF = getFunction(Callee);
-    if (!CalleeF)
-        return LogErrorV("Unknown function referenced");
+    // Callers of the old definition assume its effects, and go on doing so:
+    // they stay what the function is declared with.
+    if (OldProto && OldProto->getEffects())
+    {
+        if (!FE.isWithin(*OldProto->getEffects()))
+        {
+            LogError("a redefinition can't have side effects the old definition didn't");
+            return Fail();
+        }
+        FE = *OldProto->getEffects();
+    }
 
-    // If argument mismatch error.
-    if (CalleeF->arg_size() != Args.size())
-        return LogErrorV("Incorrect # arguments passed");
+    P.setEffects(FE);
+    Function *TheFunction = getFunction(P.getName());
+    if (!TheFunction)
+        return Fail();
 
-    std::vector<Value *> ArgsV;
-    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    // A memo function's symbol is the cache lookup, and its body goes in an
+    // internal function that the lookup calls on a miss.
+    Function *MemoFn = nullptr;
+    if (P.isMemo())
     {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
-            return nullptr;
+        MemoFn = TheFunction;
+        TheFunction = Function::Create(MemoFn->getFunctionType(), Function::InternalLinkage, P.getName() + ".body",
+                                       TheModule.get());
+        TheFunction->setAttributes(MemoFn->getAttributes());
+        for (auto &Arg : TheFunction->args())
+            Arg.setName(MemoFn->getArg(Arg.getArgNo())->getName());
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
+    // If this is an operator, install it.
+    if (P.isBinaryOp())
+        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
 
-Value *IfExprAST::codegen()
-{
-    Value *CondV = Cond->codegen();
-    if (!CondV)
-        return nullptr;
+    // Create a new basic block to start insertion into.
+    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+    Builder->SetInsertPoint(BB);
 
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    CondV = Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
+    // Record the function arguments in the NamedValues map.
+    NamedValues.clear();
+    CountedLoops.clear();
+    LoopExits.clear();
+    ParallelChunks.clear();
+    CurFnProto = &P;
+    CurFnArgAllocas.clear();
+    for (auto &Arg : TheFunction->args())
+    {
+        // Create an alloca for this variable.
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
 
-    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+        // Store the initial value into the alloca.
+        Builder->CreateStore(&Arg, Alloca);
 
-    // Create blocks for the then and else cases.  Insert the 'then' block at the
-    // end of the function.
-    BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunction);
-    BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
-    BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+        // Add arguments to variable symbol table.
+        NamedValues[std::string(Arg.getName())] = Alloca;
+        CurFnArgAllocas.push_back(Alloca);
+    }
 
-    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    // Self tail calls turn into branches back to here, past the stores of the
+    // incoming arguments.
+    TailRecurseBB = BasicBlock::Create(*TheContext, "tailrecurse", TheFunction);
+    Builder->CreateBr(TailRecurseBB);
+    Builder->SetInsertPoint(TailRecurseBB);
 
-    // Emit then value.
-    Builder->SetInsertPoint(ThenBB);
+    // The body is in tail position, so it emits the function's returns itself.
+    if (Body->codegenReturn() && (!P.isMultiVersion() || checkMultiVersionCalls(*TheFunction)))
+    {
+        // Drop the code after breaks and returns, so that every pass sees a
+        // CFG with only reachable blocks.
+        removeUnreachableBlocks(*TheFunction);
+        for (Function *Chunk : ParallelChunks)
+            removeUnreachableBlocks(*Chunk);
 
-    Value *ThenV = Then->codegen();
-    if (!ThenV)
-        return nullptr;
+        // Validate the generated code, checking for consistency.
+        verifyFunction(*TheFunction);
+        for (Function *Chunk : ParallelChunks)
+            verifyFunction(*Chunk);
+
+        // A multiversion function's body moves into one copy per feature
+        // level, and the function itself becomes the stub that picks one.
+        std::vector<Function *> Bodies = {TheFunction};
+        if (P.isMultiVersion())
+            if (auto Versions = emitMultiVersions(*TheFunction); !Versions.empty())
+                Bodies = std::move(Versions);
+
+        // Calls are counted in every copy of the body that gets optimized.
+        auto countBodyCalls = [&] {
+            unsigned N = 0;
+            for (Function *Fn : Bodies)
+                N += countCalls(*Fn);
+            for (Function *Chunk : ParallelChunks)
+                N += countCalls(*Chunk);
+            return N;
+        };
+        unsigned CallsBefore = countBodyCalls();
+
+        // In lazy and tiered modes the JIT optimizes each function when it is
+        // called, which leaves nothing here to inline or specialize from.
+        if (!optimizesInJIT())
+        {
+            // Inline small functions and user operators defined in earlier
+            // modules, then run the optimizer on the function.  Each version
+            // is optimized, and vectorized, for its own feature level.
+            for (Function *Fn : Bodies)
+            {
+                NumCallsInlined += inlineImportedCallees(*Fn);
+                TheFPM->run(*Fn, *TheFAM);
+                NumLoopsVectorized += countVectorizedLoops(*Fn);
+
+                // Constant arguments to earlier functions are now as folded
+                // as they will get.
+                NumCallsSpecialized += specializeCalls(*Fn, StringRef(P.getName()).starts_with("__"));
+            }
+
+            // The bodies of parallel loops are optimized the same way.  They
+            // run in a loop even in a top-level expression.
+            for (Function *Chunk : ParallelChunks)
+            {
+                NumCallsInlined += inlineImportedCallees(*Chunk);
+                TheFPM->run(*Chunk, *TheFAM);
+                NumLoopsVectorized += countVectorizedLoops(*Chunk);
+                NumCallsSpecialized += specializeCalls(*Chunk, /*RunsOnce=*/false);
+            }
+        }
 
-    Builder->CreateBr(MergeBB);
-    // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-    ThenBB = Builder->GetInsertBlock();
+        // Earlier callers that copied the old body in keep it.  From now on
+        // the function is only called through its stub.
+        if (OldProto)
+        {
+            if (auto It = RetainedIR.find(Name); It != RetainedIR.end())
+            {
+                if (!It->second.Importers.empty())
+                    fprintf(stderr, "Note: %s inlined or specialized the old %s, and keeps it until redefined\n",
+                            join(It->second.Importers, ", ").c_str(), Name.c_str());
+                RetainedIR.erase(It);
+            }
+        }
+        if (!StringRef(Name).starts_with("__"))
+            DefinedFunctions.insert(Name);
 
-    // Emit else block.
-    TheFunction->insert(TheFunction->end(), ElseBB);
-    Builder->SetInsertPoint(ElseBB);
+        ++NumFunctionsDefined;
+        if (FE.isPure() && !FE.InaccessibleMemory)
+            ++NumFunctionsInferredPure;
+        NumCallsBeforeOpt += CallsBefore;
+        NumCallsAfterOpt += countBodyCalls();
 
-    Value *ElseV = Else->codegen();
-    if (!ElseV)
-        return nullptr;
+        if (MemoFn)
+        {
+            emitMemoLookup(*MemoFn, *TheFunction, P);
+            verifyFunction(*MemoFn);
+            if (!optimizesInJIT())
+                TheFPM->run(*MemoFn, *TheFAM);
+            return MemoFn;
+        }
 
-    Builder->CreateBr(MergeBB);
-    // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-    ElseBB = Builder->GetInsertBlock();
+        // Keep the optimized body around so that later uses can specialize
+        // it, and inline it if it's an operator.  Top-level expressions and
+        // global initializers are never called again, and inlining a
+        // multiversion function would lose its versions.
+        if (!optimizesInJIT() && !StringRef(P.getName()).starts_with("__") && !P.isMultiVersion() &&
+            !OldProto)
+            retainIR(*TheFunction, P.isUnaryOp() || P.isBinaryOp());
 
-    // Emit merge block.
-    TheFunction->insert(TheFunction->end(), MergeBB);
-    Builder->SetInsertPoint(MergeBB);
-    PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+        return TheFunction;
+    }
 
-    PN->addIncoming(ThenV, ThenBB);
-    PN->addIncoming(ElseV, ElseBB);
-    return PN;
+    // Error reading body, remove function.
+    TheFunction->eraseFromParent();
+    if (MemoFn)
+        MemoFn->eraseFromParent();
+    for (Function *Chunk : ParallelChunks)
+        Chunk->dropAllReferences();
+    for (Function *Chunk : ParallelChunks)
+        Chunk->eraseFromParent();
+
+    if (P.isBinaryOp() && !OldProto)
+        BinopPrecedence.erase(P.getOperatorName());
+    return Fail();
 }
 
-// Output for-loop as:
-//   var = alloca double
-//   ...
-//   start = startexpr
-//   store start -> var
-//   goto loop
-// loop:
-//   ...
-//   bodyexpr
-//   ...
-// loopend:
-//   step = stepexpr
-//   endcond = endexpr
-//
-//   curvar = load var
-//   nextvar = curvar + step
-//   store nextvar -> var
-//   br endcond, loop, endloop
-// outloop:
-Value *ForExprAST::codegen()
+const GlobalDecl *GlobalAST::codegen()
 {
-    Function *TheFunction = Builder->GetInsertBlock()->getParent();
-
-    // Create an alloca for the variable in the entry block.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-
-    // Emit the start code first, without 'variable' in scope.
-    Value *StartVal = Start->codegen();
-    if (!StartVal)
+    if (Globals.count(Name))
+    {
+        LogError("a const or global with this name already exists");
         return nullptr;
+    }
 
-    // Store the value into the alloca.
-    Builder->CreateStore(StartVal, Alloca);
-
-    // Make the new basic block for the loop header, inserting after current
-    // block.
-    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
-
-    // Insert an explicit fall through from the current block to the LoopBB.
-    Builder->CreateBr(LoopBB);
+    // The initializer runs once, now, as a function of no arguments returning
+    // the declared type.  Bools come back as ints, which C reads reliably.
+    auto Proto = std::make_unique<PrototypeAST>("__init_expr", std::vector<std::string>(), std::vector<ValueType>(),
+                                                ValueType::Double);
+    ValueType Ty = Annotation ? *Annotation : inferLocalTypes(*Proto, *Init, /*IntLiterals=*/true);
+    if (IsConst ? !isScalar(Ty) : isVector(Ty))
+    {
+        LogError(IsConst ? "consts must be numbers" : "globals can't be vectors");
+        return nullptr;
+    }
+    Proto = std::make_unique<PrototypeAST>("__init_expr", std::vector<std::string>(), std::vector<ValueType>(),
+                                           Ty == ValueType::Bool ? ValueType::Int : Ty);
+    FunctionAST InitFn(std::move(Proto), std::move(Init));
+    if (!InitFn.codegen())
+        return nullptr;
 
-    // Start insertion in LoopBB.
-    Builder->SetInsertPoint(LoopBB);
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT));
+    InitializeModule();
 
-    // Within the loop, the variable is defined equal to the PHI node.  If it
-    // shadows an existing variable, we have to restore it, so save it now.
-    AllocaInst *OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Alloca;
+    uint64_t Bits;
+    if (Ty == ValueType::Double)
+        Bits = llvm::bit_cast<uint64_t>(ExitOnErr(TheJIT->getFunction<double()>("__init_expr"))());
+    else if (isScalar(Ty))
+        Bits = ExitOnErr(TheJIT->getFunction<int64_t()>("__init_expr"))();
+    else
+        Bits = reinterpret_cast<uintptr_t>(ExitOnErr(TheJIT->getFunction<void *()>("__init_expr"))());
+    ExitOnErr(RT->remove());
+
+    GlobalDecl &G = Globals[Name] = {Ty, IsConst, Bits};
+    if (IsConst)
+        return &G;
+
+    // Define the global in a module of its own, which stays in the JIT for the
+    // rest of the session.
+    getGlobalVariable(Name, G)->setInitializer(getGlobalConstant(Ty, Bits));
+    ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+    InitializeModule();
+    return &G;
+}
 
-    // Emit the body of the loop.  This, like any other expr, can change the
-    // current BB.  Note that we ignore the value computed by the body, but don't
-    // allow an error.
-    if (!Body->codegen())
-        return nullptr;
+//===----------------------------------------------------------------------===//
+// Effect Analysis
+//===----------------------------------------------------------------------===//
 
-    // Emit the step value.
-    Value *StepVal = nullptr;
-    if (Step)
+/// getExternEffects - Effects of the C functions scripts commonly extern.  The
+/// math functions are modelled as if errno were never set (-fno-math-errno).
+static std::optional<FunctionEffects> getExternEffects(const std::string &Name)
+{
+    static const char *PureMath[] = {"sin",   "cos",  "tan",  "asin",  "acos", "atan", "atan2", "sinh",
+                                     "cosh",  "tanh", "exp",  "exp2",  "log",  "log2", "log10", "pow",
+                                     "sqrt",  "cbrt", "fabs", "floor", "ceil", "round", "trunc", "fmod",
+                                     "hypot", "fmin", "fmax"};
+    for (const char *Fn : PureMath)
+        if (Name == Fn)
+            return FunctionEffects();
+
+    // The I/O helpers in the runtime library below touch memory but always
+    // return normally.
+    if (Name == "putchard" || Name == "printd")
     {
-        StepVal = Step->codegen();
-        if (!StepVal)
-            return nullptr;
+        FunctionEffects FE;
+        FE.ReadsMemory = FE.WritesMemory = true;
+        return FE;
     }
-    else
+    return std::nullopt;
+}
+
+/// addCallEffects - Merge the effects of calling Callee into FE.
+static void addCallEffects(const std::string &Callee, const std::string &Self, FunctionEffects &FE)
+{
+    // Direct recursion adds no effects of its own, but nothing guarantees it
+    // terminates.
+    if (Callee == Self)
     {
-        // If not specified, use 1.0.
-        StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+        FE.MayRecurse = FE.MayNotReturn = true;
+        return;
     }
 
-    // Compute the end condition.
-    Value *EndCond = End->codegen();
-    if (!EndCond)
-        return nullptr;
+    auto FI = FunctionProtos.find(Callee);
+    if (FI != FunctionProtos.end() && FI->second->getEffects())
+        FE.merge(*FI->second->getEffects());
+    else
+        FE.merge(FunctionEffects::unknown());
+}
 
-    // Reload, increment, and restore the alloca.  This handles the case where
-    // the body of the loop mutates the variable.
-    Value *CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, VarName.c_str());
-    Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
-    Builder->CreateStore(NextVar, Alloca);
+void UnaryExprAST::collectEffects(const std::string &Self, FunctionEffects &FE) const
+{
+    Operand->collectEffects(Self, FE);
+    addCallEffects(std::string("unary") + Opcode, Self, FE);
+}
+
+void BinaryExprAST::collectEffects(const std::string &Self, FunctionEffects &FE) const
+{
+    // Assignment to a local or one of its vector lanes only touches its
+    // promotable alloca; storing to an array element or a global is a real
+    // write.
+    if (Op != '=')
+        LHS->collectEffects(Self, FE);
+    else if (auto *LHSI = dyn_cast<IndexExprAST>(LHS.get()))
+    {
+        LHS->collectEffects(Self, FE);
+        if (!LHSI->isVectorLane())
+            FE.WritesMemory = true;
+    }
+    else if (auto *LHSE = dyn_cast<VariableExprAST>(LHS.get()); LHSE && LHSE->getGlobal())
+        FE.WritesMemory = true;
+    RHS->collectEffects(Self, FE);
 
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    EndCond = Builder->CreateFCmpONE(EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+    if (!isBuiltinBinop(Op))
+        addCallEffects(std::string("binary") + (char)Op, Self, FE);
+}
 
-    // Create the "after loop" block and insert it.
-    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+void CallExprAST::collectEffects(const std::string &Self, FunctionEffects &FE) const
+{
+    for (auto &Arg : Args)
+        Arg->collectEffects(Self, FE);
+    addCallEffects(Callee, Self, FE);
+}
 
-    // Insert the conditional branch into the end of LoopEndBB.
-    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+void IfExprAST::collectEffects(const std::string &Self, FunctionEffects &FE) const
+{
+    Cond->collectEffects(Self, FE);
+    Then->collectEffects(Self, FE);
+    Else->collectEffects(Self, FE);
+}
 
-    // Any new code will be inserted in AfterBB.
-    Builder->SetInsertPoint(AfterBB);
+void ForExprAST::collectEffects(const std::string &Self, FunctionEffects &FE) const
+{
+    Start->collectEffects(Self, FE);
+    End->collectEffects(Self, FE);
+    if (Step)
+        Step->collectEffects(Self, FE);
+    Body->collectEffects(Self, FE);
 
-    // Restore the unshadowed variable.
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
+    // The end condition is an arbitrary expression, so we can't prove that the
+    // loop terminates.
+    FE.MayNotReturn = true;
+}
 
-    // for expr always returns 0.0.
-    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+void WhileExprAST::collectEffects(const std::string &Self, FunctionEffects &FE) const
+{
+    Cond->collectEffects(Self, FE);
+    Body->collectEffects(Self, FE);
+    FE.MayNotReturn = true;
 }
 
-Value *VarExprAST::codegen()
+void VarExprAST::collectEffects(const std::string &Self, FunctionEffects &FE) const
 {
-    std::vector<AllocaInst *> OldBindings;
+    for (auto &Var : VarNames)
+        if (Var.second)
+            Var.second->collectEffects(Self, FE);
+    Body->collectEffects(Self, FE);
+}
 
-    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+//===----------------------------------------------------------------------===//
+// Type Inference
+//===----------------------------------------------------------------------===//
 
-    // Register all variables and emit their initializer.
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    {
-        const std::string &VarName = VarNames[i].first;
-        ExprAST *Init = VarNames[i].second.get();
+/// getCallResultType - The return type of Callee, or double if it is unknown
+/// (codegen reports the error).
+static ValueType getCallResultType(const std::string &Callee)
+{
+    auto FI = FunctionProtos.find(Callee);
+    if (FI == FunctionProtos.end())
+        return ValueType::Double;
+    return FI->second->getReturnType();
+}
 
-        // Emit the initializer before adding the variable to scope, this prevents
-        // the initializer from referencing the variable itself, and permits stuff
-        // like this:
-        //  var a = 1 in
-        //    var a = a in ...   # refers to outer 'a'.
-        Value *InitVal;
-        if (Init)
+ValueType VariableExprAST::inferType(TypeScope &Scope)
+{
+    auto It = Scope.Vars.find(Name);
+    if (It != Scope.Vars.end())
+    {
+        Global = nullptr;
+        if (bool *IntUse = It->second.IntUse; IntUse && Scope.IntExpr == this && !*IntUse)
         {
-            InitVal = Init->codegen();
-            if (!InitVal)
-                return nullptr;
-        }
-        else
-        { // If not specified, use 0.0.
-            InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
+            *IntUse = true;
+            Scope.Changed = true;
         }
+        return *It->second.Ty;
+    }
 
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-        Builder->CreateStore(InitVal, Alloca);
+    // Not a local, so a const or global if there is one by this name.
+    auto GIt = Globals.find(Name);
+    Global = GIt == Globals.end() ? nullptr : &GIt->second;
+    return Global ? Global->Ty : ValueType::Double;
+}
 
-        // Remember the old variable binding so that we can restore the binding when
-        // we unrecurse.
-        OldBindings.push_back(NamedValues[VarName]);
+ValueType UnaryExprAST::inferType(TypeScope &Scope)
+{
+    Operand->inferType(Scope);
+    return getCallResultType(std::string("unary") + Opcode);
+}
 
-        // Remember this binding.
-        NamedValues[VarName] = Alloca;
+ValueType BinaryExprAST::inferType(TypeScope &Scope)
+{
+    // An assignment widens the variable to the assigned type and yields the
+    // variable's (possibly already wider) type.  A value assigned to something
+    // declared int, or to a var read as one, must be an int.
+    if (Op == '=')
+    {
+        auto *LHSE = dyn_cast<VariableExprAST>(LHS.get());
+        if (!LHSE && !isa<IndexExprAST>(LHS.get()))
+            return RHS->inferType(Scope);
+        ValueType L = LHS->inferType(Scope);
+        auto It = LHSE ? Scope.Vars.find(LHSE->getName()) : Scope.Vars.end();
+        bool IntTarget = L == ValueType::Int;
+        if (It != Scope.Vars.end())
+            IntTarget = It->second.Annotated ? IntTarget : It->second.IntUse && *It->second.IntUse;
+        ValueType R = IntTarget ? Scope.inferInt(*RHS) : RHS->inferType(Scope);
+        if (!LHSE)
+            return L;
+        if (It == Scope.Vars.end())
+        {
+            // Globals keep the type they were declared with.
+            return LHSE->getGlobal() ? L : R;
+        }
+        Scope.widen(It->second, R);
+        return *It->second.Ty;
     }
 
-    // Codegen the body, now that all vars are in scope.
-    Value *BodyVal = Body->codegen();
-    if (!BodyVal)
-        return nullptr;
-
-    // Pop all our variables from scope.
-    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-        NamedValues[VarNames[i].first] = OldBindings[i];
+    // Arithmetic on ints is done in int, so an int result needs int operands;
+    // so does an int loop's end condition.
+    bool IntOperands = Op == '+' || Op == '-' || Op == '*' || isBooleanOp(Op);
+    ValueType R = IntOperands ? Scope.inferLike(this, *RHS) : RHS->inferType(Scope);
+    ValueType L = IntOperands ? Scope.inferLike(this, *LHS) : LHS->inferType(Scope);
+    if (isBuiltinBinop(Op))
+        return getBuiltinBinopType(Op, L, R);
+    return getCallResultType(std::string("binary") + (char)Op);
+}
 
-    // Return the body computation.
-    return BodyVal;
+ValueType CallExprAST::inferType(TypeScope &Scope)
+{
+    auto FI = FunctionProtos.find(Callee);
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    {
+        if (FI != FunctionProtos.end() && i < FI->second->getArgTypes().size() &&
+            FI->second->getArgTypes()[i] == ValueType::Int)
+            Scope.inferInt(*Args[i]);
+        else
+            Args[i]->inferType(Scope);
+    }
+    return getCallResultType(Callee);
 }
 
-Function *PrototypeAST::codegen()
+ValueType IfExprAST::inferType(TypeScope &Scope)
 {
-    // Make the function type:  double(double,double) etc.
-    std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+    Cond->inferType(Scope);
+    ValueType ThenTy = Scope.inferLike(this, *Then);
+    ValueType ElseTy = Scope.inferLike(this, *Else);
+    // Only numbers widen; codegen reports arms of other types that disagree.
+    // An arm that breaks or returns yields a bool, and the other arm's type.
+    if (isScalar(ThenTy) && isScalar(ElseTy))
+        return std::max(ThenTy, ElseTy);
+    return ThenTy == ValueType::Bool ? ElseTy : ThenTy;
+}
 
-    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+ValueType ForExprAST::inferType(TypeScope &Scope)
+{
+    // The variable counts, so it is an int unless the start or step isn't.
+    TypeScope::Binding Var = {&VarType, VarAnnotation.has_value()};
+    Scope.widen(Var, Scope.inferInt(*Start));
+
+    // The step, body and end condition all see the loop variable.
+    std::optional<TypeScope::Binding> OldVar;
+    if (auto It = Scope.Vars.find(VarName); It != Scope.Vars.end())
+        OldVar = It->second;
+    Scope.Vars[VarName] = Var;
+
+    Body->inferType(Scope);
+    Scope.widen(Var, Step ? Scope.inferInt(*Step) : ValueType::Int);
+    if (VarType == ValueType::Int)
+        Scope.inferInt(*End);
+    else
+        End->inferType(Scope);
 
-    // Set names for all arguments.
-    unsigned Idx = 0;
-    for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
+    if (OldVar)
+        Scope.Vars[VarName] = *OldVar;
+    else
+        Scope.Vars.erase(VarName);
 
-    return F;
+    // for expr always returns 0.0.
+    return ValueType::Double;
 }
 
-Function *FunctionAST::codegen()
+ValueType ParallelForExprAST::inferType(TypeScope &Scope)
 {
-    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-    // reference to it for use below.
-    auto &P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
-    Function *TheFunction = getFunction(P.getName());
-    if (!TheFunction)
-        return nullptr;
+    Scope.inferInt(*Start);
+    Scope.inferInt(*End);
 
-    // If this is an operator, install it.
-    if (P.isBinaryOp())
-        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    // Only the body sees the variable, which is always an int.
+    TypeScope::Binding Var = {&VarType, true};
+    std::optional<TypeScope::Binding> OldVar;
+    if (auto It = Scope.Vars.find(VarName); It != Scope.Vars.end())
+        OldVar = It->second;
+    Scope.Vars[VarName] = Var;
 
-    // Create a new basic block to start insertion into.
-    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
+    Body->inferType(Scope);
 
-    // Record the function arguments in the NamedValues map.
-    NamedValues.clear();
-    for (auto &Arg : TheFunction->args())
-    {
-        // Create an alloca for this variable.
-        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+    if (OldVar)
+        Scope.Vars[VarName] = *OldVar;
+    else
+        Scope.Vars.erase(VarName);
 
-        // Store the initial value into the alloca.
-        Builder->CreateStore(&Arg, Alloca);
+    // parallel for expr always returns 0.0.
+    return ValueType::Double;
+}
 
-        // Add arguments to variable symbol table.
-        NamedValues[std::string(Arg.getName())] = Alloca;
-    }
+ValueType RangeReduceExprAST::inferType(TypeScope &Scope)
+{
+    TypeScope::Binding Var = {&VarType, VarAnnotation.has_value()};
+    Scope.widen(Var, Scope.inferInt(*Start));
+    Scope.widen(Var, Scope.inferInt(*End));
+    Scope.widen(Var, ValueType::Int);
+
+    // Only the body sees the variable.
+    std::optional<TypeScope::Binding> OldVar;
+    if (auto It = Scope.Vars.find(VarName); It != Scope.Vars.end())
+        OldVar = It->second;
+    Scope.Vars[VarName] = Var;
+
+    // Reducing bools counts them.
+    Ty = std::max(Body->inferType(Scope), ValueType::Int);
+
+    if (OldVar)
+        Scope.Vars[VarName] = *OldVar;
+    else
+        Scope.Vars.erase(VarName);
+
+    return Ty;
+}
+
+ValueType WhileExprAST::inferType(TypeScope &Scope)
+{
+    Cond->inferType(Scope);
+    Body->inferType(Scope);
+    return ValueType::Double;
+}
+
+ValueType VarExprAST::inferType(TypeScope &Scope)
+{
+    std::vector<std::optional<TypeScope::Binding>> OldBindings;
 
-    if (Value *RetVal = Body->codegen())
+    // Each initializer sees the variables bound before it, just like codegen.
+    // A variable without one starts out as a zero.  One that is read as an
+    // int, or declared one, is initialized with one; the rest hold doubles
+    // once every use has been found.
+    for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
     {
-        // Finish off the function.
-        Builder->CreateRet(RetVal);
+        const std::string &VarName = VarNames[i].first;
+        ExprAST *Init = VarNames[i].second.get();
 
-        // Validate the generated code, checking for consistency.
-        verifyFunction(*TheFunction);
+        bool Annotated = VarAnnotations[i].has_value();
+        TypeScope::Binding Var = {&VarTypes[i], Annotated, Annotated ? nullptr : &IntUses[i]};
+        bool IntVar = IntUses[i] || (Annotated && VarTypes[i] == ValueType::Int);
+        ValueType InitTy = !Init ? ValueType::Int : IntVar ? Scope.inferInt(*Init) : Init->inferType(Scope);
+        if (InitTy == ValueType::Int && !Annotated && !IntUses[i] && !Scope.IntLiterals)
+            InitTy = ValueType::Double;
+        Scope.widen(Var, InitTy);
+
+        auto It = Scope.Vars.find(VarName);
+        OldBindings.push_back(It != Scope.Vars.end() ? std::optional(It->second) : std::nullopt);
+        Scope.Vars[VarName] = Var;
+    }
 
-        // Run the optimizer on the function.
-        TheFPM->run(*TheFunction, *TheFAM);
+    ValueType BodyTy = Scope.inferLike(this, *Body);
 
-        return TheFunction;
+    // Pop all our variables from scope, innermost first.
+    for (unsigned i = VarNames.size(); i-- != 0;)
+    {
+        if (OldBindings[i])
+            Scope.Vars[VarNames[i].first] = *OldBindings[i];
+        else
+            Scope.Vars.erase(VarNames[i].first);
     }
 
-    // Error reading body, remove function.
-    TheFunction->eraseFromParent();
+    return BodyTy;
+}
 
-    if (P.isBinaryOp())
-        BinopPrecedence.erase(P.getOperatorName());
-    return nullptr;
+/// inferLocalTypes - Infer the types of the unannotated var and for bindings in
+/// the body of P.  A binding takes the type of its initializer, widened by
+/// every value assigned to it.  Widening can change the types of expressions
+/// seen earlier, so iterate until nothing changes; since types only ever
+/// widen, that takes at most a few rounds.  That is done twice: once with
+/// every literal without a '.' an int, to find the var bindings read as ints,
+/// and once more letting the others become doubles, unless IntLiterals says
+/// to keep them ints.  Returns the type of the body.
+static ValueType inferLocalTypes(const PrototypeAST &P, ExprAST &Body, bool IntLiterals)
+{
+    std::vector<ValueType> ArgTypes = P.getArgTypes();
+    TypeScope Scope;
+    Scope.IntReturn = P.getReturnType() == ValueType::Int;
+    ValueType BodyTy;
+    while (true)
+    {
+        do
+        {
+            Scope.Changed = false;
+            Scope.Vars.clear();
+            for (unsigned i = 0, e = ArgTypes.size(); i != e; ++i)
+                Scope.Vars[P.getArgs()[i]] = {&ArgTypes[i], /*Annotated=*/true};
+            BodyTy = Scope.IntReturn ? Scope.inferInt(Body) : Body.inferType(Scope);
+        } while (Scope.Changed);
+        if (IntLiterals || !Scope.IntLiterals)
+            return BodyTy;
+        Scope.IntLiterals = false;
+    }
 }
 
 //===----------------------------------------------------------------------===//
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
-static void InitializeModuleAndManagers()
+static cl::opt<bool> PrintStats("print-stats", cl::desc("Print optimization statistics on exit"), cl::init(false));
+static cl::opt<unsigned> CompileThreads("compile-threads",
+                                        cl::desc("Threads compiling definitions in the background while later ones "
+                                                 "are parsed (0 compiles each one as it is read)"),
+                                        cl::init(0));
+static cl::opt<std::string> ObjectCacheDir("object-cache-dir",
+                                           cl::desc("Directory to keep compiled objects in, so that later runs "
+                                                    "skip compiling the same code"),
+                                           cl::init(""));
+static cl::opt<uint64_t> ObjectCacheSize("object-cache-size",
+                                         cl::desc("Megabytes the object cache may grow to before the least "
+                                                  "recently used objects are deleted"),
+                                         cl::init(256));
+static cl::opt<std::string> JITCPU("jit-cpu",
+                                   cl::desc("CPU to compile for instead of the host's, for code that is the same on "
+                                            "every machine (e.g. x86-64-v2)"),
+                                   cl::init(""));
+static cl::opt<std::string> JITFeatures("jit-features",
+                                        cl::desc("Comma-separated target features to add or, with a '-', remove "
+                                                 "(e.g. +avx2,-fma)"),
+                                        cl::init(""));
+static cl::opt<unsigned> JITSlabSize("jit-slab-size",
+                                     cl::desc("Megabytes of address space reserved at a time for JIT'd code"),
+                                     cl::init(64));
+// For measuring how long it takes to get the result of the first top-level
+// expression, which is what lazy compilation is meant to improve.
+static std::chrono::steady_clock::time_point StartTime;
+static std::optional<std::chrono::steady_clock::duration> FirstResultLatency;
+// Time from reading a top-level expression to having run it and freed its
+// code, summed over the session, which is what a REPL user waits for.
+static std::chrono::steady_clock::duration TopLevelExprTime{};
+static unsigned NumTopLevelExprs = 0;
+
+static void InitializeModule()
 {
     // Open a new context and module.
     TheContext = std::make_unique<LLVMContext>();
     TheModule = std::make_unique<Module>("KaleidoscopeJIT", *TheContext);
     TheModule->setDataLayout(TheJIT->getDataLayout());
+    TheModule->setTargetTriple(TheJIT->getTargetMachine().getTargetTriple().str());
 
     // Create a new builder for the module.
     Builder = std::make_unique<IRBuilder<>>(*TheContext);
 
-    // Create new pass and analysis managers.
+    // Drop analysis results cached for the previous module, which now belongs
+    // to the JIT.  The managers themselves live for the whole session.
+    TheMAM->clear();
+    TheCGAM->clear();
+    TheFAM->clear();
+    TheLAM->clear();
+}
+
+/// InitializeManagers - Build the pass pipeline and analysis managers once for
+/// the whole session; only the module and context change between definitions.
+static void InitializeManagers()
+{
     TheFPM = std::make_unique<FunctionPassManager>();
     TheLAM = std::make_unique<LoopAnalysisManager>();
     TheFAM = std::make_unique<FunctionAnalysisManager>();
     TheCGAM = std::make_unique<CGSCCAnalysisManager>();
     TheMAM = std::make_unique<ModuleAnalysisManager>();
     ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-    TheSI = std::make_unique<StandardInstrumentations>(*TheContext,
-                                                       /*DebugLogging*/ true);
+    // The instrumentation keeps a reference to its context, so give it one
+    // that outlives the per-module contexts.
+    TheSIContext = std::make_unique<LLVMContext>();
+    TheSI = std::make_unique<StandardInstrumentations>(*TheSIContext,
+                                                       /*DebugLogging*/ false);
     TheSI->registerCallbacks(*ThePIC, TheMAM.get());
 
     // Add transform passes.
@@ -1234,15 +5225,30 @@ static void InitializeModuleAndManagers()
     TheFPM->addPass(InstCombinePass());
     // Reassociate expressions.
     TheFPM->addPass(ReassociatePass());
+    // Hoist loop-invariant code, including calls to functions inferred pure.
+    TheFPM->addPass(createFunctionToLoopPassAdaptor(LICMPass(LICMOptions()), /*UseMemorySSA=*/true));
+    // Split loops on conditions that don't change inside them, such as array
+    // bounds checks hoisted out of counted loops.
+    TheFPM->addPass(
+        createFunctionToLoopPassAdaptor(SimpleLoopUnswitchPass(/*NonTrivial=*/true), /*UseMemorySSA=*/true));
     // Eliminate Common SubExpressions.
     TheFPM->addPass(GVNPass());
+    // Turn remaining tail calls into loops or mark them as tail calls.
+    TheFPM->addPass(TailCallElimPass());
     // Simplify the control flow graph (deleting unreachable blocks, etc).
     TheFPM->addPass(SimplifyCFGPass());
+    // Vectorize loops over arrays and clean up after the vectorizer.
+    TheFPM->addPass(LoopVectorizePass());
+    TheFPM->addPass(InstCombinePass());
+    TheFPM->addPass(SimplifyCFGPass());
 
-    // Register analysis passes used in these transform passes.
-    PassBuilder PB;
+    // Register analysis passes used in these transform passes.  The target
+    // machine tells the vectorizer what the host's vector registers look like.
+    PassBuilder PB(&TheJIT->getTargetMachine());
     PB.registerModuleAnalyses(*TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
     PB.registerFunctionAnalyses(*TheFAM);
+    PB.registerLoopAnalyses(*TheLAM);
     PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
 }
 
@@ -1256,7 +5262,7 @@ static void HandleDefinition()
             FnIR->print(errs());
             fprintf(stderr, "\n");
             ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-            InitializeModuleAndManagers();
+            InitializeModule();
         }
     }
     else
@@ -1270,6 +5276,8 @@ static void HandleExtern()
 {
     if (auto ProtoAST = ParseExtern())
     {
+        if (auto FE = getExternEffects(ProtoAST->getName()))
+            ProtoAST->setEffects(*FE);
         if (auto *FnIR = ProtoAST->codegen())
         {
             fprintf(stderr, "Read extern: ");
@@ -1285,8 +5293,39 @@ static void HandleExtern()
     }
 }
 
+static void HandleGlobal()
+{
+    if (auto GlobalDef = ParseGlobal())
+    {
+        if (auto *G = GlobalDef->codegen())
+            fprintf(stderr, "Read %s %s: %s\n", G->IsConst ? "const" : "global", GlobalDef->getName().c_str(),
+                    getTypeName(G->Ty));
+    }
+    else
+    {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
+
+static void HandleRecord()
+{
+    if (auto R = ParseRecord())
+    {
+        fprintf(stderr, "Read record: %s, %zu fields, %s layout\n", R->Name.c_str(), R->Fields.size(),
+                R->AoS ? "array-of-structs" : "struct-of-arrays");
+        Records.push_back(std::move(*R));
+    }
+    else
+    {
+        // Skip token for error recovery.
+        getNextToken();
+    }
+}
+
 static void HandleTopLevelExpression()
 {
+    auto Start = std::chrono::steady_clock::now();
     // Evaluate a top-level expression into an anonymous function.
     if (auto FnAST = ParseTopLevelExpr())
     {
@@ -1298,18 +5337,21 @@ static void HandleTopLevelExpression()
 
             auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
             ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-            InitializeModuleAndManagers();
-
-            // Search the JIT for the __anon_expr symbol.
-            auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+            InitializeModule();
 
-            // Get the symbol's address and cast it to the right type (takes no
-            // arguments, returns a double) so we can call it as a native function.
-            // double (*FP)() = ExprSymbol.toPtr<double (*)()>();
-            // fprintf(stderr, "Evaluated to %f\n", FP());
+            // Search the JIT for the __anon_expr symbol, as a function that
+            // takes no arguments and returns a double, and run it.
+            // In lazy mode, the call is what compiles the code it runs.
+            auto *FP = ExitOnErr(TheJIT->getFunction<double()>("__anon_expr"));
+            double Result = FP();
+            if (!FirstResultLatency)
+                FirstResultLatency = std::chrono::steady_clock::now() - StartTime;
+            fprintf(stderr, "Evaluated to %f\n", Result);
 
             // Delete the anonymous expression module from the JIT.
             ExitOnErr(RT->remove());
+            TopLevelExprTime += std::chrono::steady_clock::now() - Start;
+            ++NumTopLevelExprs;
         }
     }
     else
@@ -1319,7 +5361,83 @@ static void HandleTopLevelExpression()
     }
 }
 
-/// top ::= definition | external | expression | ';'
+/// getHostVecType - The vector type that fills one of the host's SIMD
+/// registers, as the target machine's cost model reports it.
+static ValueType getHostVecType()
+{
+    LLVMContext Ctx;
+    Module M("host", Ctx);
+    Function *F = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false), Function::ExternalLinkage,
+                                   "probe", M);
+    TargetTransformInfo TTI = TheJIT->getTargetMachine().getTargetTransformInfo(*F);
+    unsigned Bits = TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedValue();
+    return getVecType(std::clamp(Bits / 64, 2u, 8u)).value_or(ValueType::Vec2);
+}
+
+/// PrintStatistics - Report what the optimizer did over the whole session.
+static void PrintStatistics()
+{
+    fprintf(stderr, "=== Statistics ===\n");
+    fprintf(stderr, "%u functions defined, %u inferred readnone\n", NumFunctionsDefined, NumFunctionsInferredPure);
+    // Inlining can add calls as well as remove them.
+    fprintf(stderr, "%u calls before optimization, %u after (%lld removed)\n", NumCallsBeforeOpt, NumCallsAfterOpt,
+            (long long)NumCallsBeforeOpt - NumCallsAfterOpt);
+    fprintf(stderr, "%u calls inlined across modules\n", NumCallsInlined);
+    fprintf(stderr, "%u self tail calls turned into loops, %u calls marked musttail\n", NumTailCallsToLoops,
+            NumMustTailCalls);
+    fprintf(stderr, "%u array bounds checks emitted, %u hoisted out of loops\n", NumBoundsChecks,
+            NumBoundsChecksHoisted);
+    fprintf(stderr, "%u loops vectorized\n", NumLoopsVectorized);
+    fprintf(stderr, "%u calls specialized on constant arguments, %u specializations compiled\n",
+            NumCallsSpecialized, NumSpecializations);
+    fprintf(stderr, "%u parallel loops outlined\n", NumParallelLoops);
+    fprintf(stderr, "%u functions redefined in place\n", TheJIT->getNumRedefinitions());
+    fprintf(stderr, "%u symbol lookups, %u answered from the address cache\n",
+            TheJIT->getNumAddressCacheHits() + TheJIT->getNumAddressCacheMisses(), TheJIT->getNumAddressCacheHits());
+    fprintf(stderr, "%u functions compiled in %zu versions each\n", NumMultiVersioned,
+            NumMultiVersioned ? getMultiVersionTargets().size() : size_t(0));
+
+    // The whole input has been read, but definitions may still be compiling.
+    TheJIT->waitForBackgroundCompiles();
+    double LoadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - StartTime).count();
+    if (TieredJIT)
+        fprintf(stderr, "%u functions compiled at tier 0, %u recompiled at -O3 once hot\n",
+                TheJIT->getNumTier0Functions(), TheJIT->getNumTierUps());
+    else
+        fprintf(stderr, "%u functions compiled to machine code (%s)\n", TheJIT->getNumFunctionsCompiled(),
+                LazyJIT ? "lazily" : "eagerly");
+    if (FirstResultLatency)
+        fprintf(stderr, "first top-level expression done %.3f ms after startup\n",
+                std::chrono::duration<double, std::milli>(*FirstResultLatency).count());
+    if (NumTopLevelExprs)
+        fprintf(stderr, "%u top-level expressions evaluated, %.1f us each on average\n", NumTopLevelExprs,
+                std::chrono::duration<double, std::micro>(TopLevelExprTime).count() / NumTopLevelExprs);
+    fprintf(stderr, "%u definitions loaded in %.3f ms (%.0f per second), %u compiled in the background on %u threads\n",
+            NumFunctionsDefined, LoadMs, NumFunctionsDefined * 1000 / LoadMs, TheJIT->getNumBackgroundCompiles(),
+            unsigned(CompileThreads));
+    LinkStatsPlugin &Links = TheJIT->getLinkStats();
+    fprintf(stderr, "%u objects linked (%.1f KB) in %.3f ms, onto %zu pages\n", Links.getNumLinked(),
+            Links.getBytesLinked() / 1024.0, std::chrono::duration<double, std::milli>(Links.getLinkTime()).count(),
+            Links.getNumPages());
+#ifndef _WIN32
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+#ifdef __APPLE__
+    long MaxRSSKB = Usage.ru_maxrss / 1024; // Bytes on macOS, KB elsewhere.
+#else
+    long MaxRSSKB = Usage.ru_maxrss;
+#endif
+    fprintf(stderr, "peak resident set %ld KB\n", MaxRSSKB);
+#endif
+    if (!ObjectCacheDir.empty())
+        fprintf(stderr, "object cache: %u modules loaded, %u compiled and stored\n", TheJIT->getNumObjectCacheHits(),
+                TheJIT->getNumObjectCacheMisses());
+    for (auto &Cache : MemoCaches)
+        fprintf(stderr, "memo %s: %llu hits, %llu misses\n", Cache->Name.c_str(), (unsigned long long)Cache->Hits,
+                (unsigned long long)Cache->Misses);
+}
+
+/// top ::= definition | external | record | globaldecl | expression | ';'
 static void MainLoop()
 {
     while (true)
@@ -1338,6 +5456,13 @@ static void MainLoop()
         case tok_extern:
             HandleExtern();
             break;
+        case tok_record:
+            HandleRecord();
+            break;
+        case tok_const:
+        case tok_global:
+            HandleGlobal();
+            break;
         default:
             HandleTopLevelExpression();
             break;
@@ -1369,12 +5494,251 @@ extern "C" DLLEXPORT double printd(double X)
     return 0;
 }
 
+/// kal_array_new - Allocate N zero-filled elements of Stride 8-byte slots each,
+/// laid out as N followed by the slots.  Arrays have a stride of one and
+/// collections of records one slot per field.  They are never freed.
+extern "C" DLLEXPORT void *kal_array_new(int64_t N, int64_t Stride)
+{
+    int64_t *A = nullptr;
+    if (N >= 0 && N <= (INT64_MAX / (int64_t)sizeof(double) - 1) / Stride)
+        A = static_cast<int64_t *>(calloc(1, sizeof(int64_t) + N * Stride * sizeof(double)));
+    if (!A)
+    {
+        fprintf(stderr, "Error: cannot allocate an array of length %lld\n", (long long)N);
+        exit(1);
+    }
+    A[0] = N;
+    return A;
+}
+
+/// kal_index_error - Report an out of bounds array index and exit.
+extern "C" DLLEXPORT void kal_index_error(int64_t Index, int64_t Len)
+{
+    fprintf(stderr, "Error: index %lld out of bounds for array of length %lld\n", (long long)Index, (long long)Len);
+    exit(1);
+}
+
+/// kal_cpu_level - The index, in getMultiVersionTargets, of the newest level
+/// whose features this machine has, as x86-64-v2, -v3 and -v4 define them.
+/// The vector levels also need the OS to save the wider registers.
+extern "C" DLLEXPORT int64_t kal_cpu_level()
+{
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__))
+    static const int64_t Level = [] {
+        unsigned A, B, C, D, Ext = 0, Leaf7 = 0;
+        uint64_t XCR0 = 0;
+        if (!__get_cpuid(1, &A, &B, &C, &D))
+            return 0;
+        if (__get_cpuid(0x80000001, &A, &B, &Ext, &D) == 0)
+            Ext = 0;
+        if (__get_cpuid_count(7, 0, &A, &Leaf7, &B, &D) == 0)
+            Leaf7 = 0;
+        if (C & bit_OSXSAVE)
+        {
+            unsigned Lo, Hi;
+            __asm__("xgetbv" : "=a"(Lo), "=d"(Hi) : "c"(0));
+            XCR0 = (uint64_t(Hi) << 32) | Lo;
+        }
+        auto Has = [](uint64_t Bits, uint64_t Want) { return (Bits & Want) == Want; };
+
+        if (!Has(C, bit_CMPXCHG16B | bit_POPCNT | bit_SSE3 | bit_SSE4_1 | bit_SSE4_2 | bit_SSSE3) ||
+            !Has(Ext, bit_LAHF_LM))
+            return 0;
+        // XCR0 bits 1 and 2: SSE and AVX state.
+        if (!Has(C, bit_AVX | bit_F16C | bit_FMA | bit_MOVBE | bit_OSXSAVE | bit_XSAVE) ||
+            !Has(Leaf7, bit_AVX2 | bit_BMI | bit_BMI2) || !Has(Ext, bit_ABM) || !Has(XCR0, 0x6))
+            return 1;
+        // XCR0 bits 5 to 7: the opmask registers and the upper ZMM state.
+        if (!Has(Leaf7, bit_AVX512BW | bit_AVX512CD | bit_AVX512DQ | bit_AVX512F | bit_AVX512VL) ||
+            !Has(XCR0, 0xe6))
+            return 2;
+        return 3;
+    }();
+    return Level;
+#else
+    return 0;
+#endif
+}
+
+/// kal_memo_lookup - Look Key up in memo cache C, storing the result it maps
+/// to in *Result if there is one.
+extern "C" DLLEXPORT bool kal_memo_lookup(MemoCache *C, const uint64_t *Key, uint64_t *Result)
+{
+    std::lock_guard<std::mutex> Guard(C->Lock);
+    uint64_t *Entry = C->getEntry(Key);
+    if (Entry[0] && std::equal(Key, Key + C->NumArgs, Entry + 1))
+    {
+        ++C->Hits;
+        *Result = Entry[C->NumArgs + 1];
+        return true;
+    }
+    ++C->Misses;
+    return false;
+}
+
+/// kal_memo_store - Remember in memo cache C that Key maps to Result,
+/// replacing whatever shared its entry.
+extern "C" DLLEXPORT void kal_memo_store(MemoCache *C, const uint64_t *Key, uint64_t Result)
+{
+    std::lock_guard<std::mutex> Guard(C->Lock);
+    uint64_t *Entry = C->getEntry(Key);
+    Entry[0] = 1;
+    std::copy(Key, Key + C->NumArgs, Entry + 1);
+    Entry[C->NumArgs + 1] = Result;
+}
+
+static cl::opt<unsigned> ParallelThreads("parallel-threads",
+                                         cl::desc("Worker threads for parallel loops, besides the thread that "
+                                                  "starts one (default: one per additional core)"),
+                                         cl::init(0));
+
+/// ParallelTask - A chunk of a parallel loop: Body(Env, Lo, Hi) runs its
+/// iterations Lo to Hi - 1, and the task then counts itself off in Pending.
+struct ParallelTask
+{
+    void (*Body)(void *, int64_t, int64_t);
+    void *Env;
+    int64_t Lo, Hi;
+    std::atomic<int64_t> *Pending;
+};
+
+/// WorkStealingPool - The threads that run parallel loops.  Every thread has
+/// a deque of tasks: it pushes and pops its own at the back, and once that is
+/// empty steals from the front of the others', where the oldest work is.  A
+/// thread waiting for its loop to finish keeps running tasks meanwhile, so a
+/// parallel loop inside another one's body can't starve the pool.  Threads
+/// outside the pool, like the REPL's, share the first deque.
+class WorkStealingPool
+{
+    struct Queue
+    {
+        std::mutex Lock;
+        std::deque<ParallelTask> Tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> Queues;
+    std::vector<std::thread> Workers;
+    std::atomic<int64_t> Queued{0};
+    std::mutex SleepLock;
+    std::condition_variable Wake;
+
+    static thread_local unsigned Self; // This thread's queue.
+
+    std::optional<ParallelTask> take()
+    {
+        for (unsigned i = 0, e = Queues.size(); i != e; ++i)
+        {
+            Queue &Q = *Queues[(Self + i) % e];
+            std::lock_guard<std::mutex> Guard(Q.Lock);
+            if (Q.Tasks.empty())
+                continue;
+            ParallelTask T;
+            if (i == 0)
+            {
+                T = Q.Tasks.back();
+                Q.Tasks.pop_back();
+            }
+            else
+            {
+                T = Q.Tasks.front();
+                Q.Tasks.pop_front();
+            }
+            --Queued;
+            return T;
+        }
+        return std::nullopt;
+    }
+
+    static void run(const ParallelTask &T)
+    {
+        T.Body(T.Env, T.Lo, T.Hi);
+        T.Pending->fetch_sub(1, std::memory_order_release);
+    }
+
+    void work(unsigned Slot)
+    {
+        Self = Slot;
+        while (true)
+        {
+            if (auto T = take())
+            {
+                run(*T);
+                continue;
+            }
+            std::unique_lock<std::mutex> Guard(SleepLock);
+            Wake.wait(Guard, [this] { return Queued > 0; });
+        }
+    }
+
+  public:
+    WorkStealingPool(unsigned NumWorkers)
+    {
+        for (unsigned i = 0; i <= NumWorkers; ++i)
+            Queues.push_back(std::make_unique<Queue>());
+        for (unsigned i = 1; i <= NumWorkers; ++i)
+            Workers.emplace_back(&WorkStealingPool::work, this, i);
+    }
+
+    /// parallelFor - Run Body over [Lo, Hi) in chunks, a few per thread to
+    /// even out iterations of different cost, and wait for all of them.
+    void parallelFor(void (*Body)(void *, int64_t, int64_t), void *Env, int64_t Lo, int64_t Hi)
+    {
+        uint64_t N = (uint64_t)Hi - (uint64_t)Lo;
+        uint64_t NumChunks = std::min<uint64_t>(N, Queues.size() * 4);
+        uint64_t Size = N / NumChunks, Rem = N % NumChunks;
+        std::atomic<int64_t> Pending(NumChunks);
+        {
+            Queue &Q = *Queues[Self];
+            std::lock_guard<std::mutex> Guard(Q.Lock);
+            int64_t ChunkLo = Lo;
+            for (uint64_t c = 0; c != NumChunks; ++c)
+            {
+                int64_t ChunkHi = ChunkLo + (int64_t)(Size + (c < Rem));
+                Q.Tasks.push_back({Body, Env, ChunkLo, ChunkHi, &Pending});
+                ChunkLo = ChunkHi;
+            }
+            Queued += NumChunks;
+        }
+
+        // Taking the lock orders this after any sleeper's check of Queued.
+        {
+            std::lock_guard<std::mutex> Guard(SleepLock);
+        }
+        Wake.notify_all();
+
+        while (Pending.load(std::memory_order_acquire) > 0)
+        {
+            if (auto T = take())
+                run(*T);
+            else
+                std::this_thread::yield();
+        }
+    }
+};
+
+thread_local unsigned WorkStealingPool::Self = 0;
+
+/// kal_parallel_for - Run Body(Env, lo, hi) over slices of [Lo, Hi) on the
+/// thread pool and return once all of them are done.
+extern "C" DLLEXPORT void kal_parallel_for(void (*Body)(void *, int64_t, int64_t), void *Env, int64_t Lo, int64_t Hi)
+{
+    // The pool is never destroyed, as a loop body that exits the process
+    // (say on a bad index) would have to join its own thread.
+    static WorkStealingPool *Pool = new WorkStealingPool(
+        ParallelThreads ? ParallelThreads : std::max(std::thread::hardware_concurrency(), 1u) - 1);
+    if (Lo < Hi)
+        Pool->parallelFor(Body, Env, Lo, Hi);
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main()
+int main(int argc, char **argv)
 {
+    StartTime = std::chrono::steady_clock::now();
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
     InitializeNativeTargetAsmParser();
@@ -1382,21 +5746,42 @@ int main()
     // Install standard binary operators.
     // 1 is lowest precedence.
     BinopPrecedence['='] = 2;
+    BinopPrecedence[tok_or] = 5;
+    BinopPrecedence[tok_and] = 6;
+    BinopPrecedence[tok_eq] = 9;
+    BinopPrecedence[tok_ne] = 9;
     BinopPrecedence['<'] = 10;
+    BinopPrecedence['>'] = 10;
+    BinopPrecedence[tok_le] = 10;
+    BinopPrecedence[tok_ge] = 10;
     BinopPrecedence['+'] = 20;
     BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40; // highest.
+    BinopPrecedence['*'] = 40;
+    BinopPrecedence['/'] = 40; // highest.
 
     // Prime the first token.
     fprintf(stderr, "ready> ");
     getNextToken();
 
-    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    if (LazyJIT && TieredJIT)
+    {
+        fprintf(stderr, "Error: -lazy and -tiered can't be used together\n");
+        return 1;
+    }
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create(
+        LazyJIT ? CompileMode::Lazy : TieredJIT ? CompileMode::Tiered : CompileMode::Eager, TierUpThreshold,
+        CompileThreads, ObjectCacheDir, uint64_t(ObjectCacheSize) << 20, size_t(JITSlabSize) << 20, JITCPU,
+        JITFeatures));
+    NativeVecType = getHostVecType();
 
-    InitializeModuleAndManagers();
+    InitializeManagers();
+    InitializeModule();
 
     // Run the main "interpreter loop" now.
     MainLoop();
 
+    if (PrintStats)
+        PrintStatistics();
+
     return 0;
 }
\ No newline at end of file